@@ -0,0 +1,51 @@
+/*-
+ * SPDX-License-Identifier: 0BSD
+ *
+ * Copyright (c) 2025 V. Prokopenko
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define KTRACE_MAX_ARGS 4
+
+/* One trace event, as /dev/ktraceraw hands it out */
+typedef struct
+{
+  uint64_t seq;   /* sequence number + 1, 0 while being written */
+  uint64_t tsc;
+  uint64_t fmt;   /* address of the format string in the kernel image */
+  uint64_t nargs;
+  uint64_t args[KTRACE_MAX_ARGS];
+} ktrace_record_t;
+
+void ktrace_emit (const char *fmt, const uint64_t *args, int nargs);
+
+/* Record an event for /dev/ktrace without formatting it. Only the format
+ * pointer and up to KTRACE_MAX_ARGS integer arguments are stored; the text
+ * is made when the trace is read, in the kernel or by tools/ktrace. The
+ * format must be a string literal, %s arguments must point to strings that
+ * live forever, and pointers have to be cast to uintptr_t. */
+#define ktrace(fmt, ...)                                                      \
+  do                                                                          \
+    {                                                                         \
+      const uint64_t ktrace_args_[] = { 0, ##__VA_ARGS__ };                   \
+      _Static_assert (sizeof (ktrace_args_)                                   \
+                          <= (KTRACE_MAX_ARGS + 1) * sizeof (uint64_t),       \
+                      "ktrace: too many arguments");                          \
+      ktrace_emit ("" fmt, ktrace_args_ + 1,                                  \
+                   sizeof (ktrace_args_) / sizeof (uint64_t) - 1);            \
+    }                                                                         \
+  while (0)
@@ -17,4 +17,15 @@
 
 #pragma once
 
+#include <stdint.h>
+
+struct ksym
+{
+  uint64_t addr;
+  const char *name;
+};
+
 void panic (const char *fmt);
+
+/* Find the kernel symbol containing an address, NULL if there is none */
+const struct ksym *odb_addr_to_sym (uint64_t rip);
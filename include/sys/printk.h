@@ -17,6 +17,53 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
+/* Log levels. printk (KERN_ERR "...") logs at LOG_ERR; without a prefix
+ * messages are LOG_INFO. */
+#define LOG_EMERG 0
+#define LOG_ALERT 1
+#define LOG_CRIT 2
+#define LOG_ERR 3
+#define LOG_WARNING 4
+#define LOG_NOTICE 5
+#define LOG_INFO 6
+#define LOG_DEBUG 7
+
+#define KERN_EMERG "\0010"
+#define KERN_ALERT "\0011"
+#define KERN_CRIT "\0012"
+#define KERN_ERR "\0013"
+#define KERN_WARNING "\0014"
+#define KERN_NOTICE "\0015"
+#define KERN_INFO "\0016"
+#define KERN_DEBUG "\0017"
+
+/* Longest message printk() takes, including the NUL. Longer ones are cut and
+ * end in a newline. */
+#define PRINTK_MAX 1000
+
+/* Log a message. It is drawn on the console by the next printk_flush(). */
 void printk (const char *fmt, ...);
+
+/* Draw everything logged since the last flush on the console. Called from
+ * the idle loop; until it first runs, printk() flushes by itself. */
+void printk_flush (void);
+
+/* A console printk() output goes to. `sync' is set after a panic, when the
+ * text has to be out before the call returns. */
+typedef void (*printk_sink_t) (const char *text, int level, bool sync);
+
+/* Add a console. It starts with the oldest message still in the log. */
+void printk_add_sink (printk_sink_t write);
+
+/* Drain the log for a panic and draw every later message right away */
+void printk_panic (void);
+
+int snprintf (char *buffer, int size, const char *fmt, ...);
+
+/* snprintf() with the arguments already widened to 64 bits each, as a
+ * ktrace() record stores them. Missing arguments format as 0. */
+int snprintf_raw (char *buffer, int size, const char *fmt,
+                  const uint64_t *args, int nargs);
@@ -0,0 +1,35 @@
+/*-
+ * SPDX-License-Identifier: 0BSD
+ *
+ * Copyright (c) 2025 V. Prokopenko
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Kinds of page faults counted per process */
+enum
+{
+  PROC_FAULT_DEMAND, /* first touch of a demand paged page */
+  PROC_FAULT_COW,    /* write to a copy-on-write page */
+  PROC_FAULT_BAD,    /* not resolved */
+  PROC_FAULT_KINDS
+};
+
+/* Charge a page fault to the current process */
+void proc_count_fault (int kind);
+
+/* FPU save area of the current process, NULL if it has none */
+void *proc_fpu_state (void);
@@ -19,10 +19,10 @@
 
 #include <stddef.h>
 
-void *memcpy (void *restrict dest, const void *restrict src, int n);
-void *memset (void *s, int c, int n);
-void *memmove (void *dest, const void *src, int n);
-int memcmp (const void *s1, const void *s2, int n);
+void *memcpy (void *restrict dest, const void *restrict src, size_t n);
+void *memset (void *s, int c, size_t n);
+void *memmove (void *dest, const void *src, size_t n);
+int memcmp (const void *s1, const void *s2, size_t n);
 size_t kstrlen (const char *s);
 void kstrcpy (char *dst, const char *src);
 char* kstrncpy(char* dest, const char* src, size_t n);
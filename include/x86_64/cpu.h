@@ -0,0 +1,66 @@
+/*-
+ * SPDX-License-Identifier: 0BSD
+ *
+ * Copyright (c) 2025 V. Prokopenko
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* CPU features the kernel cares about, filled in by cpu_init() */
+typedef struct
+{
+  bool gbpages; /* 1 GiB pages at the PDPT level */
+  bool pcid;    /* process-context identifiers, enabled in CR4 if present */
+  bool pge;     /* global pages, enabled in CR4 if present */
+  bool erms;    /* enhanced rep movsb/stosb */
+  bool fsrm;    /* fast short rep movsb */
+  bool xsave;   /* XSAVE/XRSTOR, enabled by fpu_init() */
+  bool xsaveopt;
+  bool xsaves;  /* compacted supervisor XSAVES/XRSTORS */
+  bool avx;     /* usable only once fpu_init() enabled it in XCR0 */
+  bool avx2;
+} cpu_features_t;
+
+extern cpu_features_t cpu_features;
+
+/* Probe the boot CPU. Must run before vmm_init() */
+void cpu_init (void);
+
+void cpuid (uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx,
+            uint32_t *edx);
+
+/* cpuid with an explicit subleaf in ecx */
+void cpuid_count (uint32_t leaf, uint32_t subleaf, uint32_t *eax,
+                  uint32_t *ebx, uint32_t *ecx, uint32_t *edx);
+
+/* Flush the whole TLB including global entries. Needs cpu_features.pge */
+void cpu_flush_global_tlb (void);
+
+/* Disable interrupts, returning the previous RFLAGS for cpu_irq_restore() */
+uint64_t cpu_irq_save (void);
+
+/* Re-enable interrupts if they were enabled when cpu_irq_save() was called */
+void cpu_irq_restore (uint64_t flags);
+
+/* Read the time stamp counter */
+static inline uint64_t
+cpu_rdtsc (void)
+{
+  uint32_t lo, hi;
+  asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
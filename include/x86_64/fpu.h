@@ -0,0 +1,52 @@
+/*-
+ * SPDX-License-Identifier: 0BSD
+ *
+ * Copyright (c) 2025 V. Prokopenko
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+/* Turn on the FPU and SSE, and XSAVE and AVX where the CPU has them. Must
+ * run after heap_init() and before proc_init() */
+void fpu_init (void);
+
+/* A task's saved FPU/SSE/AVX state, allocated holding the initial state.
+ * NULL before fpu_init(). */
+void *fpu_state_alloc (void);
+
+void fpu_state_free (void *state);
+
+/* Save the live registers to `state', or load them from there */
+void fpu_save (void *state);
+
+void fpu_restore (void *state);
+
+/* Bracket kernel code that touches FPU or vector registers. Code in files
+ * named *_sse.c and *_avx2.c (see usr/share/os.mk) may only run in between,
+ * and *_avx2.c code only if cpu_features.avx2 is set. The live task state
+ * is saved on entry and reloaded lazily after exit. Interrupts are off in
+ * between, so keep these sections short. Calls nest. */
+void kernel_fpu_begin (void);
+
+void kernel_fpu_end (void);
+
+/* Called by the scheduler before switching to the task owning `next'. The
+ * registers are loaded on the task's first FPU instruction, if any. */
+void fpu_switch (void *next);
+
+/* #NM handler: load the current task's state. Returns false if the trap
+ * was not caused by lazy switching. */
+bool fpu_handle_nm (void);
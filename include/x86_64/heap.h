@@ -8,13 +8,40 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
 void heap_init (void);
 
 void *kmalloc (size_t size);
 
+/* Allocate `size' bytes aligned to `align', a power of two. Page aligned
+ * and multi-page requests get whole pages of their own, so a page aligned
+ * page costs one page. krealloc() does not keep the alignment. */
+void *kmalloc_aligned (size_t size, size_t align);
+
 void kfree (void *ptr);
 
 void *kcalloc (size_t num, size_t size);
 
 void *krealloc (void *ptr, size_t size);
+
+typedef struct
+{
+  uint64_t krealloc_in_place; /* resized without moving */
+  uint64_t krealloc_moved;    /* had to allocate, copy and free */
+  uint64_t large_count;       /* live page-granular allocations */
+  uint64_t large_pages;       /* pages they hold */
+} heap_stats_t;
+
+void heap_get_stats (heap_stats_t *stats);
+
+typedef struct
+{
+  uint64_t mapped;      /* bytes mapped for the TLSF heap */
+  uint64_t free;        /* free bytes in it */
+  uint64_t largest;     /* largest free block */
+  uint64_t free_blocks; /* number of free blocks */
+} heap_usage_t;
+
+/* Free space of the TLSF heap. Walks every free list. */
+void heap_get_usage (heap_usage_t *usage);
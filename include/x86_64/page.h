@@ -14,12 +14,33 @@
 /* Initialize the physical memory manager */
 void pmm_init (void);
 
+/* Give bootloader reclaimable memory to the allocator. The Limine responses
+ * live there, so call it once they are no longer needed */
+void pmm_reclaim_bootloader (void);
+
 /* Allocate a single page (PAGE_SIZE bytes) of physical memory */
 void *allocate_page (void);
 
+/* Like allocate_page(), but the contents of the page are left undefined. Use
+ * it when the caller overwrites the whole page anyway. */
+void *allocate_page_nozero (void);
+
+/* Zero free pages ahead of time so allocate_page() can skip the memset. Meant
+ * to be called from the idle loop. */
+void pmm_refill_zero_pool (void);
+
 /* Free a previously allocated page of physical memory */
 void free_page (void *page);
 
+/* Largest block order handed out by the buddy allocator (4 MiB) */
+#define PMM_MAX_ORDER 10
+
+/* Allocate 2^order physically contiguous, zeroed pages aligned to their size */
+void *allocate_pages (size_t order);
+
+/* Free a block previously returned by allocate_pages() with the same order */
+void free_pages (void *base, size_t order);
+
 /* Get total size of manageable physical memory in bytes */
 size_t get_total_memory (void);
 
@@ -32,6 +53,16 @@ size_t get_free_memory (void);
 /* Check if a specific physical page is free (used internally by VMM) */
 bool is_page_free (uintptr_t paddr);
 
+/* Take another reference on an allocated page, e.g. when it gets shared
+ * between two address spaces. Freshly allocated pages have one reference. */
+void page_ref (uintptr_t paddr);
+
+/* Drop a reference on a page, freeing it when the last one goes away */
+void page_unref (uintptr_t paddr);
+
+/* Get the number of references held on a page */
+size_t page_refcount (uintptr_t paddr);
+
 /* Helper to align values up */
 #ifndef ALIGN_UP
 #define ALIGN_UP(value, align) (((value) + (align) - 1) & ~((align) - 1))
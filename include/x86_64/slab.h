@@ -0,0 +1,74 @@
+/*-
+ * SPDX-License-Identifier: 0BSD
+ *
+ * Copyright (c) 2025 V. Prokopenko
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Requests up to this size are served by the slab layer. Bigger ones go to
+ * the TLSF heap, or get whole pages of their own from HEAP_LARGE_MIN up. */
+#define SLAB_MAX_SIZE 2048
+
+#define KMEM_CACHE_NAME_LENGTH 20
+
+struct kmem_slab;
+
+/* A cache of equally sized objects carved out of slabs. Slabs are on one of
+ * three lists depending on how many of their objects are in use. */
+typedef struct kmem_cache
+{
+  char name[KMEM_CACHE_NAME_LENGTH];
+  size_t size;        /* bytes per object, including any padding */
+  size_t object_size; /* bytes the caller asked for */
+  size_t align;
+  size_t link_offset; /* where a free object keeps its freelist link */
+  void (*ctor) (void *);
+  uint16_t objects; /* per slab */
+  uint16_t colors;  /* number of distinct slab colors */
+  uint16_t color_next;
+  struct kmem_slab *partial;
+  struct kmem_slab *full;
+  struct kmem_slab *empty;
+  size_t active_objects;
+  size_t slab_count;
+  size_t empty_count;
+  struct kmem_cache *next; /* all caches */
+} kmem_cache_t;
+
+void slab_init (void);
+
+/* Create a cache for objects of `size' bytes aligned to `align' (a power of
+ * two, 0 for the default of 16). `ctor', if given, runs once on every
+ * object when its slab is created; objects must be freed back in their
+ * constructed state. */
+kmem_cache_t *kmem_cache_create (const char *name, size_t size, size_t align,
+                                 void (*ctor) (void *));
+
+void *kmem_cache_alloc (kmem_cache_t *cache);
+
+void kmem_cache_free (kmem_cache_t *cache, void *obj);
+
+/* Allocate an object of at least `size' bytes from the kmalloc caches,
+ * 16-byte aligned */
+void *slab_alloc (size_t size);
+
+/* Free an object from any cache */
+void slab_free (void *ptr);
+
+/* Usable size of an object returned by slab_alloc() */
+size_t slab_size (void *ptr);
@@ -19,5 +19,10 @@
 
 #include <x86_64/vmm/vmm_map.h>
 
-pagemap_t *vmm_clone_pagemap (pagemap_t *src);
-void vmm_free_pagemap_clone (pagemap_t *clone);
\ No newline at end of file
+/* Share data pages copy-on-write instead of copying them */
+#define VMM_CLONE_COW (1 << 0)
+
+/* Clone the userspace half of a pagemap, for fork() */
+pagemap_t *vmm_clone_pagemap (pagemap_t *src, int clone_flags);
+void vmm_free_pagemap_clone (pagemap_t *clone);
+bool vmm_handle_cow_fault (pagemap_t *pagemap, uintptr_t virt_addr);
\ No newline at end of file
@@ -19,6 +19,8 @@ extern uint8_t _bss_start[], _bss_end[];
 
 /* Page size definition */
 #define PAGE_SIZE 4096
+#define PAGE_SIZE_2M (2ull * 1024 * 1024)
+#define PAGE_SIZE_1G (1024ull * 1024 * 1024)
 
 /* Page Table Entry Flags */
 #define PTE_PRESENT (1ull << 0)
@@ -30,21 +32,39 @@ extern uint8_t _bss_start[], _bss_end[];
 #define PTE_DIRTY (1ull << 6)
 #define PTE_PAT (1ull << 7)
 #define PTE_GLOBAL (1ull << 8)
+/* Large page in a PD (2 MiB) or PDPT (1 GiB) entry. Same bit as PTE_PAT in a
+ * PT entry. */
+#define PTE_PS (1ull << 7)
 #define PTE_NX (1ull << 63)
 
+/* Bits 9-11 are ignored by the MMU and free for the kernel to use */
+#define PTE_COW (1ull << 9) /* read-only share of a writable page */
+
 /* Page Table utility macros */
 #define PTE_ADDR_MASK 0x000ffffffffff000
 #define PTE_GET_ADDR(VALUE) ((VALUE) & PTE_ADDR_MASK)
 #define PTE_GET_FLAGS(VALUE) ((VALUE) & ~PTE_ADDR_MASK)
 
+struct vmm_region;
+
 typedef struct
 {
   uint64_t *top_level;
+  struct vmm_region *regions; /* demand paged ranges, see vmm_region.h */
+  uint16_t pcid;            /* only meaningful with cpu_features.pcid */
+  uint64_t pcid_generation; /* pcid is stale unless this is current */
 } pagemap_t;
 
 extern pagemap_t *kernel_pagemap;
 
-#define VMM_HIGHER_HALF (hhdm_request.response->offset)
+/* The pagemap most recently loaded with vmm_switch_to() */
+extern pagemap_t *current_pagemap;
+
+/* HHDM offset, copied out of the Limine response by pmm_init(): the
+ * response lives in bootloader reclaimable memory, which is reused later */
+extern uintptr_t hhdm_offset;
+
+#define VMM_HIGHER_HALF hhdm_offset
 
 void vmm_init (void);
 
@@ -53,9 +73,32 @@ void vmm_switch_to (pagemap_t *pagemap);
 bool vmm_map_page (pagemap_t *pagemap, uintptr_t virt_addr, uintptr_t phys_addr,
                    uint64_t flags);
 
+/* Map a 2 MiB or 1 GiB page. Both addresses must be aligned to `size' */
+bool vmm_map_large_page (pagemap_t *pagemap, uintptr_t virt_addr,
+                         uintptr_t phys_addr, uint64_t flags, size_t size);
+
 bool vmm_unmap_page (pagemap_t *pagemap, uintptr_t virt_addr);
 
 uintptr_t vmm_virt_to_phys (pagemap_t *pagemap, uintptr_t virt_addr);
 
+/* Get a pointer to the PT entry mapping virt_addr, creating the intermediate
+ * tables if `allocate' is set. Returns NULL if there is none or the address
+ * is covered by a large page. */
+uint64_t *vmm_get_pte (pagemap_t *pagemap, uintptr_t virt_addr, bool allocate);
+
+/* Flush the TLB entries of a pagemap after its entries were changed behind
+ * the back of vmm_map_page() and friends */
+void vmm_flush_pagemap (pagemap_t *pagemap);
+
+/* Flush the TLB entries of every pagemap, for changes to the kernel half */
+void vmm_flush_all (void);
+
+/* Invalidate one page after changing a present entry of a pagemap */
+void vmm_invalidate_page (pagemap_t *pagemap, uintptr_t virt_addr);
+
+/* Flags for a leaf entry mapping virt_addr. Higher-half mappings are the
+ * same in every pagemap, so they are made global to survive CR3 loads. */
+uint64_t vmm_leaf_flags (uintptr_t virt_addr, uint64_t flags);
+
 uint64_t *vmm_get_next_level (uint64_t *current_level_virt, size_t index,
                               bool allocate, uint64_t alloc_entry_flags);
\ No newline at end of file
@@ -0,0 +1,60 @@
+/*-
+ * SPDX-License-Identifier: 0BSD
+ *
+ * Copyright (c) 2025 V. Prokopenko
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <x86_64/vmm/vmm_map.h>
+
+/* Past this many pages a TLB gather gives up on invlpg and flushes the whole
+ * address space instead */
+#define VMM_GATHER_MAX_PAGES 32
+#define VMM_GATHER_MAX_TABLES 16
+
+/* Collects the TLB invalidations (and page table pages to free) of a range
+ * operation so they can be done in one go at the end */
+typedef struct
+{
+  pagemap_t *pagemap;
+  uintptr_t pages[VMM_GATHER_MAX_PAGES];
+  size_t page_count;
+  bool full_flush;
+  bool kernel_half; /* shared with every other pagemap */
+  uintptr_t tables[VMM_GATHER_MAX_TABLES];
+  size_t table_count;
+} vmm_tlb_gather_t;
+
+void vmm_gather_init (vmm_tlb_gather_t *gather, pagemap_t *pagemap);
+void vmm_gather_page (vmm_tlb_gather_t *gather, uintptr_t virt_addr);
+void vmm_gather_flush (vmm_tlb_gather_t *gather);
+
+/* Map [virt_addr, virt_addr + length) to the physically contiguous range at
+ * phys_addr with 4 KiB pages */
+bool vmm_map_range (pagemap_t *pagemap, uintptr_t virt_addr,
+                    uintptr_t phys_addr, size_t length, uint64_t flags);
+
+/* Unmap a range, freeing page tables that become empty. The mapped pages
+ * themselves are not freed. Large pages are not split: the call fails at the
+ * first one, with the range before it already unmapped. */
+bool vmm_unmap_range (pagemap_t *pagemap, uintptr_t virt_addr, size_t length);
+
+/* Replace the flags of every present page in a range. Fails at the first
+ * large page like vmm_unmap_range(). */
+bool vmm_protect_range (pagemap_t *pagemap, uintptr_t virt_addr,
+                        size_t length, uint64_t flags);
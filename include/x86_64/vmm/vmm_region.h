@@ -0,0 +1,60 @@
+/*-
+ * SPDX-License-Identifier: 0BSD
+ *
+ * Copyright (c) 2025 V. Prokopenko
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <x86_64/vmm/vmm_map.h>
+
+/* A reserved range of a pagemap whose pages are allocated, zeroed and mapped
+ * on first touch by the page fault handler */
+typedef struct vmm_region
+{
+  uintptr_t base;
+  size_t length;
+  uint64_t flags; /* PTE flags for the pages, PTE_PRESENT is implied */
+  struct vmm_region *next;
+} vmm_region_t;
+
+/* Reserve [base, base + length) in a pagemap. Nothing is mapped until the
+ * pages are accessed. Both must be page aligned. Addresses in the higher half
+ * are reserved in the kernel pagemap, which every pagemap shares. */
+bool vmm_reserve (pagemap_t *pagemap, uintptr_t base, size_t length,
+                  uint64_t flags);
+
+/* Drop the region starting at base, freeing the pages that were touched */
+bool vmm_release (pagemap_t *pagemap, uintptr_t base);
+
+/* Grow or shrink the region starting at base to `length' bytes. Growing
+ * fails if it would run into the next region; shrinking frees the pages
+ * past the new end. */
+bool vmm_resize (pagemap_t *pagemap, uintptr_t base, size_t length);
+
+vmm_region_t *vmm_find_region (pagemap_t *pagemap, uintptr_t virt_addr);
+
+/* Give `dst' a copy of the lower half regions of `src' */
+bool vmm_copy_regions (pagemap_t *dst, pagemap_t *src);
+
+/* Free the region list of a pagemap without touching its mappings */
+void vmm_free_regions (pagemap_t *pagemap);
+
+/* Populate the page containing virt_addr if it belongs to a region. Returns
+ * false if the access is not allowed by the region or there is none. */
+bool vmm_handle_demand_fault (pagemap_t *pagemap, uintptr_t virt_addr,
+                              bool write, bool user);
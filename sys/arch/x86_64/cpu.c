@@ -0,0 +1,162 @@
+/*-
+ * SPDX-License-Identifier: 0BSD
+ *
+ * Copyright (c) 2025 V. Prokopenko
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Small helpers for poking at the CPU state
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <x86_64/cpu.h>
+
+#define RFLAGS_IF (1ull << 9)
+
+#define CR4_PGE (1ull << 7)
+#define CR4_PCIDE (1ull << 17)
+
+/* CPUID 1 ECX */
+#define CPUID_ECX_PCID (1u << 17)
+#define CPUID_ECX_XSAVE (1u << 26)
+#define CPUID_ECX_AVX (1u << 28)
+
+/* CPUID 1 EDX */
+#define CPUID_EDX_PGE (1u << 13)
+
+/* CPUID 7.0 EBX */
+#define CPUID_7_EBX_AVX2 (1u << 5)
+#define CPUID_7_EBX_ERMS (1u << 9)
+
+/* CPUID 7.0 EDX */
+#define CPUID_7_EDX_FSRM (1u << 4)
+
+/* CPUID 0xD.1 EAX */
+#define CPUID_D_EAX_XSAVEOPT (1u << 0)
+#define CPUID_D_EAX_XSAVES (1u << 3)
+
+/* CPUID 0x80000001 EDX */
+#define CPUID_EXT_EDX_PDPE1GB (1u << 26)
+
+cpu_features_t cpu_features;
+
+void
+cpuid (uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx,
+       uint32_t *edx)
+{
+  cpuid_count (leaf, 0, eax, ebx, ecx, edx);
+}
+
+void
+cpuid_count (uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx,
+             uint32_t *ecx, uint32_t *edx)
+{
+  asm volatile ("cpuid"
+                : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                : "a"(leaf), "c"(subleaf));
+}
+
+void
+cpu_init (void)
+{
+  uint32_t eax, ebx, ecx, edx;
+
+  cpuid (0, &eax, &ebx, &ecx, &edx);
+  uint32_t max_leaf = eax;
+
+  cpuid (1, &eax, &ebx, &ecx, &edx);
+  cpu_features.pcid = (ecx & CPUID_ECX_PCID) != 0;
+  cpu_features.pge = (edx & CPUID_EDX_PGE) != 0;
+  cpu_features.xsave = (ecx & CPUID_ECX_XSAVE) != 0;
+  cpu_features.avx = (ecx & CPUID_ECX_AVX) != 0;
+
+  if (max_leaf >= 7)
+    {
+      cpuid_count (7, 0, &eax, &ebx, &ecx, &edx);
+      cpu_features.erms = (ebx & CPUID_7_EBX_ERMS) != 0;
+      cpu_features.fsrm = (edx & CPUID_7_EDX_FSRM) != 0;
+      cpu_features.avx2 = (ebx & CPUID_7_EBX_AVX2) != 0;
+    }
+
+  if (max_leaf >= 0xD && cpu_features.xsave)
+    {
+      cpuid_count (0xD, 1, &eax, &ebx, &ecx, &edx);
+      cpu_features.xsaveopt = (eax & CPUID_D_EAX_XSAVEOPT) != 0;
+      cpu_features.xsaves = (eax & CPUID_D_EAX_XSAVES) != 0;
+    }
+
+  cpuid (0x80000000, &eax, &ebx, &ecx, &edx);
+  uint32_t max_ext_leaf = eax;
+
+  if (max_ext_leaf >= 0x80000001)
+    {
+      cpuid (0x80000001, &eax, &ebx, &ecx, &edx);
+      cpu_features.gbpages = (edx & CPUID_EXT_EDX_PDPE1GB) != 0;
+    }
+
+  if (cpu_features.pge)
+    {
+      /* Before vmm_init() builds the kernel mappings with PTE_GLOBAL */
+      uint64_t cr4;
+      asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+      asm volatile ("mov %0, %%cr4" ::"r"(cr4 | CR4_PGE) : "memory");
+    }
+
+  if (cpu_features.pcid)
+    {
+      /* Setting CR4.PCIDE faults unless the current PCID is 0 */
+      uint64_t cr3, cr4;
+      asm volatile ("mov %%cr3, %0" : "=r"(cr3));
+      if (cr3 & 0xFFF)
+        {
+          cpu_features.pcid = false;
+          return;
+        }
+      asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+      asm volatile ("mov %0, %%cr4" ::"r"(cr4 | CR4_PCIDE) : "memory");
+    }
+}
+
+void
+cpu_flush_global_tlb (void)
+{
+  /* Toggling CR4.PGE flushes every TLB entry, global or not, for all
+   * PCIDs */
+  uint64_t flags = cpu_irq_save ();
+  uint64_t cr4;
+  asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+  asm volatile ("mov %0, %%cr4" ::"r"(cr4 & ~CR4_PGE) : "memory");
+  asm volatile ("mov %0, %%cr4" ::"r"(cr4) : "memory");
+  cpu_irq_restore (flags);
+}
+
+uint64_t
+cpu_irq_save (void)
+{
+  uint64_t flags;
+  asm volatile ("pushfq\n\t"
+                "popq %0\n\t"
+                "cli"
+                : "=r"(flags)
+                :
+                : "memory");
+  return flags;
+}
+
+void
+cpu_irq_restore (uint64_t flags)
+{
+  if (flags & RFLAGS_IF)
+    asm volatile ("sti" ::: "memory");
+}
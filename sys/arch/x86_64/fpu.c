@@ -0,0 +1,284 @@
+/*-
+ * SPDX-License-Identifier: 0BSD
+ *
+ * Copyright (c) 2025 V. Prokopenko
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * FPU, SSE and AVX state management
+ *
+ * Every task has its own save area, but the registers are switched lazily.
+ * fpu_owner is the area whose contents are live in the registers. Switching
+ * to any other task sets CR0.TS, so its first FPU or vector instruction
+ * raises #NM; only then is the owner's state saved and the task's loaded.
+ * Tasks that never touch the FPU never trap and cost nothing, and switching
+ * back to the owner just clears TS again.
+ *
+ * Kernel code is built without SSE, so the only kernel users of the vector
+ * registers are kernel_fpu_begin() sections, which save the owner's state
+ * first and leave the registers ownerless at the end.
+ *
+ * With XSAVE the area holds every component enabled in XCR0. XSAVES (or
+ * else XSAVEOPT) skips components still in their initial state or not
+ * modified since the area was last loaded, and XSAVES also uses the
+ * compacted format. Without XSAVE, FXSAVE handles x87 and SSE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/panic.h>
+#include <sys/printk.h>
+#include <sys/proc.h>
+#include <sys/string.h>
+#include <x86_64/cpu.h>
+#include <x86_64/fpu.h>
+#include <x86_64/heap.h>
+
+#define CR0_MP (1ull << 1)
+#define CR0_EM (1ull << 2)
+#define CR0_TS (1ull << 3)
+#define CR0_NE (1ull << 5)
+
+#define CR4_OSFXSR (1ull << 9)
+#define CR4_OSXMMEXCPT (1ull << 10)
+#define CR4_OSXSAVE (1ull << 18)
+
+#define XCR0_X87 (1ull << 0)
+#define XCR0_SSE (1ull << 1)
+#define XCR0_AVX (1ull << 2)
+
+#define MSR_IA32_XSS 0xDA0
+
+#define FXSAVE_SIZE 512
+#define XSAVE_ALIGN 64
+#define MXCSR_DEFAULT 0x1F80
+
+static bool fpu_ready = false;
+static size_t fpu_state_size = FXSAVE_SIZE;
+static void *fpu_initial_state = NULL;
+
+static void *fpu_owner = NULL;
+
+static int fpu_depth = 0;
+static uint64_t fpu_irq_flags;
+
+static inline void
+fpu_clts (void)
+{
+  asm volatile ("clts");
+}
+
+static inline void
+fpu_stts (void)
+{
+  uint64_t cr0;
+  asm volatile ("mov %%cr0, %0" : "=r"(cr0));
+  asm volatile ("mov %0, %%cr0" ::"r"(cr0 | CR0_TS));
+}
+
+static inline void
+xsetbv (uint32_t index, uint64_t value)
+{
+  asm volatile ("xsetbv" ::"c"(index), "a"((uint32_t)value),
+                "d"((uint32_t)(value >> 32)));
+}
+
+void
+fpu_init (void)
+{
+  uint64_t cr0, cr4;
+  asm volatile ("mov %%cr0, %0" : "=r"(cr0));
+  cr0 = (cr0 & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE;
+  asm volatile ("mov %0, %%cr0" ::"r"(cr0));
+
+  asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+  cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+  if (cpu_features.xsave)
+    cr4 |= CR4_OSXSAVE;
+  asm volatile ("mov %0, %%cr4" ::"r"(cr4));
+
+  if (cpu_features.xsave)
+    {
+      uint32_t eax, ebx, ecx, edx;
+      cpuid_count (0xD, 0, &eax, &ebx, &ecx, &edx);
+      uint64_t xcr0 = XCR0_X87 | XCR0_SSE;
+      if (cpu_features.avx && (eax & XCR0_AVX))
+        xcr0 |= XCR0_AVX;
+      xsetbv (0, xcr0);
+
+      /* EBX is the area size for what XCR0 enables now */
+      cpuid_count (0xD, 0, &eax, &ebx, &ecx, &edx);
+      fpu_state_size = ebx;
+      if (cpu_features.xsaves)
+        {
+          /* No supervisor components; the compacted area for the user
+           * ones is smaller */
+          asm volatile ("wrmsr" ::"c"(MSR_IA32_XSS), "a"(0), "d"(0));
+          cpuid_count (0xD, 1, &eax, &ebx, &ecx, &edx);
+          fpu_state_size = ebx;
+        }
+      cpu_features.avx = (xcr0 & XCR0_AVX) != 0;
+    }
+  else
+    {
+      cpu_features.avx = false;
+    }
+  cpu_features.avx2 = cpu_features.avx2 && cpu_features.avx;
+
+  /* Everything new tasks start from */
+  uint32_t mxcsr = MXCSR_DEFAULT;
+  asm volatile ("fninit");
+  asm volatile ("ldmxcsr %0" ::"m"(mxcsr));
+
+  fpu_initial_state = kmalloc_aligned (fpu_state_size, XSAVE_ALIGN);
+  if (fpu_initial_state == NULL)
+    {
+      panic ("fpu: failed to allocate the initial state");
+    }
+  memset (fpu_initial_state, 0, fpu_state_size);
+  fpu_save (fpu_initial_state);
+
+  /* The first task to use the FPU loads its own state */
+  fpu_stts ();
+  fpu_ready = true;
+  printk ("fpu: %s, %llu byte state%s\n",
+          cpu_features.xsaves     ? "xsaves"
+          : cpu_features.xsaveopt ? "xsaveopt"
+          : cpu_features.xsave    ? "xsave"
+                                  : "fxsave",
+          (uint64_t)fpu_state_size,
+          cpu_features.avx ? ", avx" : "");
+}
+
+void *
+fpu_state_alloc (void)
+{
+  if (!fpu_ready)
+    return NULL;
+
+  void *state = kmalloc_aligned (fpu_state_size, XSAVE_ALIGN);
+  if (state)
+    memcpy (state, fpu_initial_state, fpu_state_size);
+  return state;
+}
+
+void
+fpu_state_free (void *state)
+{
+  if (state != NULL && state == fpu_owner)
+    {
+      fpu_owner = NULL;
+      fpu_stts ();
+    }
+  kfree (state);
+}
+
+void
+fpu_save (void *state)
+{
+  if (cpu_features.xsaves)
+    asm volatile ("xsaves64 (%0)" ::"r"(state), "a"(~0u), "d"(~0u)
+                  : "memory");
+  else if (cpu_features.xsaveopt)
+    asm volatile ("xsaveopt64 (%0)" ::"r"(state), "a"(~0u), "d"(~0u)
+                  : "memory");
+  else if (cpu_features.xsave)
+    asm volatile ("xsave64 (%0)" ::"r"(state), "a"(~0u), "d"(~0u)
+                  : "memory");
+  else
+    asm volatile ("fxsave64 (%0)" ::"r"(state) : "memory");
+}
+
+void
+fpu_restore (void *state)
+{
+  if (cpu_features.xsaves)
+    asm volatile ("xrstors64 (%0)" ::"r"(state), "a"(~0u), "d"(~0u)
+                  : "memory");
+  else if (cpu_features.xsave)
+    asm volatile ("xrstor64 (%0)" ::"r"(state), "a"(~0u), "d"(~0u)
+                  : "memory");
+  else
+    asm volatile ("fxrstor64 (%0)" ::"r"(state) : "memory");
+}
+
+void
+kernel_fpu_begin (void)
+{
+  uint64_t flags = cpu_irq_save ();
+  if (fpu_depth++ > 0)
+    return;
+
+  if (!fpu_ready)
+    {
+      panic ("fpu: kernel_fpu_begin before fpu_init");
+    }
+  fpu_irq_flags = flags;
+
+  fpu_clts ();
+  if (fpu_owner)
+    {
+      fpu_save (fpu_owner);
+      fpu_owner = NULL;
+    }
+
+  /* Start from a known state: the task's rounding mode or exception masks
+   * are none of the kernel's business */
+  uint32_t mxcsr = MXCSR_DEFAULT;
+  asm volatile ("fninit");
+  asm volatile ("ldmxcsr %0" ::"m"(mxcsr));
+}
+
+void
+kernel_fpu_end (void)
+{
+  if (fpu_depth <= 0)
+    {
+      panic ("fpu: unbalanced kernel_fpu_end");
+    }
+  if (--fpu_depth > 0)
+    return;
+
+  /* Whoever runs next reloads its state on first use */
+  fpu_stts ();
+  cpu_irq_restore (fpu_irq_flags);
+}
+
+void
+fpu_switch (void *next)
+{
+  if (next != NULL && next == fpu_owner)
+    fpu_clts ();
+  else
+    fpu_stts ();
+}
+
+bool
+fpu_handle_nm (void)
+{
+  if (!fpu_ready || fpu_depth > 0)
+    return false;
+
+  fpu_clts ();
+  void *state = proc_fpu_state ();
+  if (state != NULL && state == fpu_owner)
+    return true;
+
+  if (fpu_owner)
+    fpu_save (fpu_owner);
+  fpu_restore (state ? state : fpu_initial_state);
+  fpu_owner = state;
+  return true;
+}
@@ -5,32 +5,279 @@
  * LICENSE.md for details.
  */
 
+#include <x86_64/cpu.h>
 #include <x86_64/heap.h>
 #include <x86_64/page.h>
+#include <x86_64/slab.h>
 #include <x86_64/vmm/vmm_map.h>
+#include <x86_64/vmm/vmm_range.h>
+#include <x86_64/vmm/vmm_region.h>
+#include <sys/mount.h>
 #include <sys/panic.h>
 #include <sys/printk.h>
 #include <sys/string.h>
 
+/* Requests bigger than SLAB_MAX_SIZE are served by a Two-Level Segregated
+ * Fit allocator. Free blocks are kept on segregated lists: the first level
+ * splits sizes by power of two, the second level splits each power of two
+ * into HEAP_SL_COUNT linear steps. Two bitmaps tell which lists are
+ * non-empty, so finding a fitting block is a couple of bit scans and
+ * malloc/free run in bounded time whatever the heap looks like.
+ *
+ * Every block starts with a header holding the address of the physically
+ * previous block and its own payload size, so a freed block is merged with
+ * both neighbours right away. An allocated block's size sits right before
+ * the pointer handed out, as it always has. A zero-sized, never-free
+ * sentinel block closes the heap. */
+
 typedef struct heap_free_block
 {
-  size_t size;
+  struct heap_free_block *prev_phys; /* physically previous block */
+  size_t size; /* payload bytes, HEAP_BLOCK_FREE in the low bit */
+  /* Free blocks only */
   struct heap_free_block *next;
+  struct heap_free_block *prev;
 } heap_free_block_t;
 
-#define MIN_ALLOC_SIZE sizeof (heap_free_block_t)
 #define HEAP_ALIGNMENT 16
+#define HEAP_HEADER_SIZE (2 * sizeof (size_t))
+#define HEAP_BLOCK_FREE 1ul
+#define MIN_ALLOC_SIZE (sizeof (heap_free_block_t) - HEAP_HEADER_SIZE)
 
 #define ALIGN_UP_HEAP(size)                                                    \
   (((size) + HEAP_ALIGNMENT - 1) & ~(HEAP_ALIGNMENT - 1))
 
+/* Second level: 16 lists per power of two. Sizes below HEAP_SMALL_SIZE all
+ * go to the first first-level list, in HEAP_ALIGNMENT steps. */
+#define HEAP_SL_SHIFT 4
+#define HEAP_SL_COUNT (1 << HEAP_SL_SHIFT)
+#define HEAP_FL_SHIFT (HEAP_SL_SHIFT + 4)
+#define HEAP_SMALL_SIZE (1ul << HEAP_FL_SHIFT)
+/* Enough for a block spanning the whole heap window */
+#define HEAP_FL_MAX 36
+#define HEAP_FL_COUNT (HEAP_FL_MAX - HEAP_FL_SHIFT + 1)
+
+/* tools/heapbench builds this file on the host and puts the heap and large
+ * allocation windows where its own address space has room */
+#ifndef KERNEL_HEAP_START
 #define KERNEL_HEAP_START 0xFFFF810000000000
+#endif
 #define INITIAL_HEAP_PAGES 256
 #define KERNEL_HEAP_INITIAL_SIZE (INITIAL_HEAP_PAGES * PAGE_SIZE)
 
+/* The heap owns this much virtual space but only maps what it needs. It
+ * grows by at least HEAP_GROW_MIN at a time and gives trailing free space
+ * back once more than HEAP_TRIM_THRESHOLD of it piles up, keeping
+ * HEAP_GROW_MIN of slack so that grow and trim don't thrash. */
+#ifndef KERNEL_HEAP_MAX_SIZE
+#define KERNEL_HEAP_MAX_SIZE (64ull * 1024 * 1024 * 1024)
+#endif
+#define HEAP_GROW_MIN (64 * PAGE_SIZE)
+#define HEAP_TRIM_THRESHOLD (1024 * PAGE_SIZE)
+
+/* Requests of HEAP_LARGE_MIN and more, and anything that has to be page
+ * aligned, skip the TLSF heap: they get whole pages in their own window
+ * right above the heap. The pages are reserved as a demand paged region of
+ * the kernel pagemap, so only the ones that are touched take memory. Each
+ * allocation is described by a heap_large_t on a list sorted by address,
+ * and an unreserved guard page follows it. */
+#define KERNEL_LARGE_START (KERNEL_HEAP_START + KERNEL_HEAP_MAX_SIZE)
+#ifndef KERNEL_LARGE_SIZE
+#define KERNEL_LARGE_SIZE (64ull * 1024 * 1024 * 1024)
+#endif
+#define HEAP_LARGE_MIN (8 * PAGE_SIZE)
+
+typedef struct heap_large
+{
+  uintptr_t base;
+  size_t pages; /* reserved pages from base */
+  struct heap_large *next;
+} heap_large_t;
+
 static void *heap_start = NULL;
-static size_t heap_size = 0;
-static heap_free_block_t *free_list_head = NULL;
+static size_t heap_size = 0; /* mapped bytes from heap_start */
+static heap_free_block_t *heap_sentinel = NULL;
+static heap_stats_t heap_stats;
+
+static heap_large_t *heap_large_list = NULL;
+static kmem_cache_t *heap_large_cache = NULL;
+
+static uint32_t heap_fl_bitmap;
+static uint32_t heap_sl_bitmap[HEAP_FL_COUNT];
+static heap_free_block_t *heap_free_lists[HEAP_FL_COUNT][HEAP_SL_COUNT];
+
+static inline size_t
+heap_block_size (heap_free_block_t *block)
+{
+  return block->size & ~HEAP_BLOCK_FREE;
+}
+
+static inline bool
+heap_block_is_free (heap_free_block_t *block)
+{
+  return block->size & HEAP_BLOCK_FREE;
+}
+
+static inline void *
+heap_block_payload (heap_free_block_t *block)
+{
+  return (void *)((uintptr_t)block + HEAP_HEADER_SIZE);
+}
+
+static inline heap_free_block_t *
+heap_payload_block (void *ptr)
+{
+  return (heap_free_block_t *)((uintptr_t)ptr - HEAP_HEADER_SIZE);
+}
+
+static inline heap_free_block_t *
+heap_block_next (heap_free_block_t *block)
+{
+  return (heap_free_block_t *)((uintptr_t)heap_block_payload (block)
+                               + heap_block_size (block));
+}
+
+static inline int
+heap_fls (size_t value)
+{
+  return 63 - __builtin_clzl (value);
+}
+
+/* First and second level index of the list holding blocks of `size' */
+static void
+heap_mapping (size_t size, int *fl, int *sl)
+{
+  if (size < HEAP_SMALL_SIZE)
+    {
+      *fl = 0;
+      *sl = size / (HEAP_SMALL_SIZE / HEAP_SL_COUNT);
+    }
+  else
+    {
+      int bit = heap_fls (size);
+      *sl = (size >> (bit - HEAP_SL_SHIFT)) ^ HEAP_SL_COUNT;
+      *fl = bit - (HEAP_FL_SHIFT - 1);
+    }
+}
+
+static void
+heap_list_insert (heap_free_block_t *block)
+{
+  int fl, sl;
+  heap_mapping (heap_block_size (block), &fl, &sl);
+
+  block->prev = NULL;
+  block->next = heap_free_lists[fl][sl];
+  if (block->next)
+    block->next->prev = block;
+  heap_free_lists[fl][sl] = block;
+
+  heap_fl_bitmap |= 1u << fl;
+  heap_sl_bitmap[fl] |= 1u << sl;
+}
+
+static void
+heap_list_remove (heap_free_block_t *block)
+{
+  int fl, sl;
+  heap_mapping (heap_block_size (block), &fl, &sl);
+
+  if (block->prev)
+    block->prev->next = block->next;
+  else
+    heap_free_lists[fl][sl] = block->next;
+  if (block->next)
+    block->next->prev = block->prev;
+
+  if (heap_free_lists[fl][sl] == NULL)
+    {
+      heap_sl_bitmap[fl] &= ~(1u << sl);
+      if (heap_sl_bitmap[fl] == 0)
+        heap_fl_bitmap &= ~(1u << fl);
+    }
+}
+
+/* Find a free block of at least `size' bytes. Searching starts at the next
+ * list up, so any block found is big enough without walking the list. */
+static heap_free_block_t *
+heap_find_free (size_t size)
+{
+  if (size >= HEAP_SMALL_SIZE)
+    size += (1ul << (heap_fls (size) - HEAP_SL_SHIFT)) - 1;
+
+  int fl, sl;
+  heap_mapping (size, &fl, &sl);
+  if (fl >= HEAP_FL_COUNT)
+    return NULL;
+
+  uint32_t sl_map = heap_sl_bitmap[fl] & (~0u << sl);
+  if (sl_map == 0)
+    {
+      uint32_t fl_map
+          = fl + 1 < HEAP_FL_COUNT ? heap_fl_bitmap & (~0u << (fl + 1)) : 0;
+      if (fl_map == 0)
+        return NULL;
+      fl = __builtin_ctz (fl_map);
+      sl_map = heap_sl_bitmap[fl];
+    }
+  sl = __builtin_ctz (sl_map);
+  return heap_free_lists[fl][sl];
+}
+
+/* Cut `block' down to `size' bytes, freeing what is left if it can hold a
+ * block of its own */
+static void
+heap_block_split (heap_free_block_t *block, size_t size)
+{
+  size_t block_size = heap_block_size (block);
+  if (block_size < size + HEAP_HEADER_SIZE + MIN_ALLOC_SIZE)
+    return;
+
+  heap_free_block_t *next = heap_block_next (block);
+  block->size = size | (block->size & HEAP_BLOCK_FREE);
+
+  heap_free_block_t *rest = heap_block_next (block);
+  rest->prev_phys = block;
+  rest->size = (block_size - size - HEAP_HEADER_SIZE) | HEAP_BLOCK_FREE;
+  next->prev_phys = rest;
+
+  if (heap_block_is_free (next))
+    {
+      heap_list_remove (next);
+      rest->size += next->size & ~HEAP_BLOCK_FREE;
+      rest->size += HEAP_HEADER_SIZE;
+      heap_block_next (rest)->prev_phys = rest;
+    }
+  heap_list_insert (rest);
+}
+
+/* Mark a block free and merge it with its free neighbours. Returns the
+ * resulting block, which is on its free list. */
+static heap_free_block_t *
+heap_block_release (heap_free_block_t *block)
+{
+  block->size |= HEAP_BLOCK_FREE;
+
+  heap_free_block_t *next = heap_block_next (block);
+  if (heap_block_is_free (next))
+    {
+      heap_list_remove (next);
+      block->size += heap_block_size (next) + HEAP_HEADER_SIZE;
+      heap_block_next (block)->prev_phys = block;
+    }
+
+  heap_free_block_t *prev = block->prev_phys;
+  if (prev && heap_block_is_free (prev))
+    {
+      heap_list_remove (prev);
+      prev->size += heap_block_size (block) + HEAP_HEADER_SIZE;
+      heap_block_next (prev)->prev_phys = prev;
+      block = prev;
+    }
+
+  heap_list_insert (block);
+  return block;
+}
 
 void
 heap_init (void)
@@ -40,150 +287,905 @@ heap_init (void)
       return;
     }
 
+  slab_init ();
+  heap_large_cache
+      = kmem_cache_create ("heap_large", sizeof (heap_large_t), 0, NULL);
+  if (heap_large_cache == NULL)
+    {
+      panic ("heap: failed to create the large allocation cache");
+    }
+
   heap_start = (void *)KERNEL_HEAP_START;
   heap_size = KERNEL_HEAP_INITIAL_SIZE;
 
-  for (size_t i = 0; i < INITIAL_HEAP_PAGES; i++)
+  /* INITIAL_HEAP_PAGES is 1 << 8, so take it as one buddy block and map it
+   * with a single page table walk per 512 pages */
+  void *phys_base = allocate_pages (8);
+  if (phys_base == NULL)
     {
-      void *phys_page = allocate_page ();
-      if (phys_page == NULL)
+      panic ("heap: failed to allocate pages");
+    }
+  if (!vmm_map_range (kernel_pagemap, KERNEL_HEAP_START, (uintptr_t)phys_base,
+                      KERNEL_HEAP_INITIAL_SIZE,
+                      PTE_PRESENT | PTE_WRITABLE | PTE_NX))
+    {
+      panic ("heap: failed to map pages");
+    }
+
+  heap_free_block_t *first = (heap_free_block_t *)heap_start;
+  heap_sentinel = (heap_free_block_t *)((uintptr_t)heap_start + heap_size
+                                        - HEAP_HEADER_SIZE);
+  first->prev_phys = NULL;
+  first->size = heap_size - 2 * HEAP_HEADER_SIZE;
+  heap_sentinel->prev_phys = first;
+  heap_sentinel->size = 0;
+  heap_block_release (first);
+}
+
+/* Whether ptr came from the heap rather than the slab layer */
+static bool
+heap_owns (void *ptr)
+{
+  return (uintptr_t)ptr >= (uintptr_t)heap_start
+         && (uintptr_t)ptr < (uintptr_t)heap_start + heap_size;
+}
+
+/* Back `bytes' (page aligned) of virtual space at `virt' with memory,
+ * taken in the largest buddy blocks that fit. Returns how much could be
+ * mapped. */
+static size_t
+heap_map_pages (uintptr_t virt, size_t bytes)
+{
+  size_t mapped = 0;
+  while (mapped < bytes)
+    {
+      size_t order = 0;
+      while (order < PMM_MAX_ORDER
+             && ((size_t)PAGE_SIZE << (order + 1)) <= bytes - mapped)
+        order++;
+
+      void *phys = allocate_pages (order);
+      while (phys == NULL && order > 0)
+        phys = allocate_pages (--order);
+      if (phys == NULL)
+        break;
+
+      if (!vmm_map_range (kernel_pagemap, virt + mapped, (uintptr_t)phys,
+                          PAGE_SIZE << order,
+                          PTE_PRESENT | PTE_WRITABLE | PTE_NX))
         {
-          panic ("heap: failed to allocate page");
+          free_pages (phys, order);
+          break;
         }
-      uintptr_t virt_addr = KERNEL_HEAP_START + (i * PAGE_SIZE);
-      if (!vmm_map_page (kernel_pagemap, virt_addr, (uintptr_t)phys_page,
-                         PTE_PRESENT | PTE_WRITABLE | PTE_NX))
+      mapped += PAGE_SIZE << order;
+    }
+  return mapped;
+}
+
+/* Give the pages behind `bytes' at `virt' back to the PMM and unmap them */
+static void
+heap_unmap_pages (uintptr_t virt, size_t bytes)
+{
+  for (uintptr_t page = virt; page < virt + bytes; page += PAGE_SIZE)
+    free_page ((void *)vmm_virt_to_phys (kernel_pagemap, page));
+  vmm_unmap_range (kernel_pagemap, virt, bytes);
+}
+
+/* Map at least `bytes' more at the end of the heap. The old sentinel turns
+ * into the header of the new free block. */
+static bool
+heap_grow (size_t bytes)
+{
+  if (bytes < HEAP_GROW_MIN)
+    bytes = HEAP_GROW_MIN;
+  bytes = ALIGN_UP (bytes, PAGE_SIZE);
+
+  if (heap_start == NULL || bytes > KERNEL_HEAP_MAX_SIZE - heap_size)
+    return false;
+
+  size_t mapped = heap_map_pages ((uintptr_t)heap_start + heap_size, bytes);
+
+  /* Whatever could be mapped is still useful */
+  if (mapped == 0)
+    return false;
+
+  heap_size += mapped;
+
+  heap_free_block_t *block = heap_sentinel;
+  block->size = mapped - HEAP_HEADER_SIZE;
+  heap_sentinel = heap_block_next (block);
+  heap_sentinel->prev_phys = block;
+  heap_sentinel->size = 0;
+  heap_block_release (block);
+
+  return mapped >= bytes;
+}
+
+/* Give the fully free pages at the end of the heap back to the PMM. `tail'
+ * is the free block right before the sentinel. */
+static void
+heap_trim (heap_free_block_t *tail)
+{
+  uintptr_t heap_end = (uintptr_t)heap_start + heap_size;
+  uintptr_t keep_end
+      = ALIGN_UP ((uintptr_t)heap_block_payload (tail) + MIN_ALLOC_SIZE
+                      + HEAP_HEADER_SIZE,
+                  PAGE_SIZE)
+        + HEAP_GROW_MIN;
+  uintptr_t floor = (uintptr_t)heap_start + KERNEL_HEAP_INITIAL_SIZE;
+  if (keep_end < floor)
+    keep_end = floor;
+  if (keep_end >= heap_end)
+    return;
+
+  heap_list_remove (tail);
+  tail->size -= heap_end - keep_end;
+  heap_sentinel = heap_block_next (tail);
+  heap_sentinel->prev_phys = tail;
+  heap_sentinel->size = 0;
+  heap_list_insert (tail);
+
+  heap_unmap_pages (keep_end, heap_end - keep_end);
+
+  heap_size -= heap_end - keep_end;
+}
+
+static size_t
+heap_request_size (size_t size)
+{
+  size_t total_size = ALIGN_UP_HEAP (size);
+  if (total_size < MIN_ALLOC_SIZE)
+    {
+      total_size = MIN_ALLOC_SIZE;
+    }
+  return total_size;
+}
+
+static void *
+heap_alloc (size_t total_size)
+{
+  heap_free_block_t *block = heap_find_free (total_size);
+  if (block == NULL)
+    {
+      /* heap_find_free() rounds up to the next list, and the sentinel
+       * becomes the new block's header */
+      size_t grow_size = total_size + (total_size >> HEAP_SL_SHIFT)
+                         + HEAP_HEADER_SIZE;
+      if (!heap_grow (grow_size))
+        return NULL;
+      block = heap_find_free (total_size);
+      if (block == NULL)
+        return NULL;
+    }
+
+  heap_list_remove (block);
+  block->size &= ~HEAP_BLOCK_FREE;
+  heap_block_split (block, total_size);
+  return heap_block_payload (block);
+}
+
+/* heap_alloc() for alignments above HEAP_ALIGNMENT: take a block with
+ * room to spare, and give back what lies before the aligned address as a
+ * free block of its own */
+static void *
+heap_alloc_aligned (size_t total_size, size_t align)
+{
+  size_t gap_min = HEAP_HEADER_SIZE + MIN_ALLOC_SIZE;
+  uintptr_t ptr = (uintptr_t)heap_alloc (total_size + align + gap_min);
+  if (ptr == 0)
+    return NULL;
+  if (ptr % align == 0)
+    {
+      /* No gap needed, give back the slack asked for it */
+      heap_block_split (heap_payload_block ((void *)ptr), total_size);
+      return (void *)ptr;
+    }
+
+  uintptr_t aligned = ALIGN_UP (ptr + gap_min, align);
+  heap_free_block_t *block = heap_payload_block ((void *)ptr);
+  heap_free_block_t *next = heap_block_next (block);
+  heap_free_block_t *aligned_block = heap_payload_block ((void *)aligned);
+
+  aligned_block->prev_phys = block;
+  aligned_block->size = (uintptr_t)next - aligned;
+  next->prev_phys = aligned_block;
+  block->size = (uintptr_t)aligned_block - ptr;
+  heap_block_release (block);
+
+  heap_block_split (aligned_block, total_size);
+  return (void *)aligned;
+}
+
+static bool
+heap_large_owns (void *ptr)
+{
+  return (uintptr_t)ptr >= KERNEL_LARGE_START
+         && (uintptr_t)ptr < KERNEL_LARGE_START + KERNEL_LARGE_SIZE;
+}
+
+/* Descriptor of the large allocation at `ptr', and the one linking to it */
+static heap_large_t *
+heap_large_find (void *ptr, heap_large_t **prev)
+{
+  *prev = NULL;
+  for (heap_large_t *large = heap_large_list; large; large = large->next)
+    {
+      if (large->base == (uintptr_t)ptr)
+        return large;
+      if (large->base > (uintptr_t)ptr)
+        break;
+      *prev = large;
+    }
+  return NULL;
+}
+
+/* End of the space `large' may grow into, leaving the guard page free */
+static uintptr_t
+heap_large_limit (heap_large_t *large)
+{
+  uintptr_t limit = large->next ? large->next->base
+                                : KERNEL_LARGE_START + KERNEL_LARGE_SIZE;
+  return limit - PAGE_SIZE;
+}
+
+static void *
+heap_large_alloc (size_t size, size_t align)
+{
+  if (size > KERNEL_LARGE_SIZE || align > KERNEL_LARGE_SIZE)
+    return NULL;
+  size_t bytes = ALIGN_UP (size, PAGE_SIZE);
+
+  heap_large_t *large = kmem_cache_alloc (heap_large_cache);
+  if (large == NULL)
+    return NULL;
+
+  uint64_t flags = cpu_irq_save ();
+
+  /* First fit between the existing allocations and their guard pages */
+  heap_large_t *prev = NULL;
+  uintptr_t base = KERNEL_LARGE_START;
+  for (heap_large_t *next = heap_large_list;; next = next->next)
+    {
+      base = ALIGN_UP (base, align);
+      uintptr_t limit
+          = next ? next->base : KERNEL_LARGE_START + KERNEL_LARGE_SIZE;
+      if (base < limit && limit - base >= bytes + PAGE_SIZE)
+        break;
+      if (next == NULL)
         {
-          panic ("heap: failed to map page");
+          cpu_irq_restore (flags);
+          kmem_cache_free (heap_large_cache, large);
+          printk ("heap: out of large allocation space\n");
+          return NULL;
         }
+      base = next->base + next->pages * PAGE_SIZE + PAGE_SIZE;
+      prev = next;
+    }
+
+  if (!vmm_reserve (kernel_pagemap, base, bytes,
+                    PTE_PRESENT | PTE_WRITABLE | PTE_NX))
+    {
+      cpu_irq_restore (flags);
+      kmem_cache_free (heap_large_cache, large);
+      printk ("heap: out of memory for a large allocation\n");
+      return NULL;
     }
 
-  free_list_head = (heap_free_block_t *)heap_start;
-  free_list_head->size = heap_size;
-  free_list_head->next = NULL;
+  large->base = base;
+  large->pages = bytes / PAGE_SIZE;
+  large->next = prev ? prev->next : heap_large_list;
+  if (prev)
+    prev->next = large;
+  else
+    heap_large_list = large;
+
+  heap_stats.large_count++;
+  heap_stats.large_pages += large->pages;
+  cpu_irq_restore (flags);
+
+  return (void *)base;
 }
 
-void *
-kmalloc (size_t size)
+static void
+heap_large_free (void *ptr)
+{
+  uint64_t flags = cpu_irq_save ();
+  heap_large_t *prev;
+  heap_large_t *large = heap_large_find (ptr, &prev);
+  if (large == NULL)
+    {
+      panic ("heap: invalid pointer passed to kfree");
+    }
+
+  if (prev)
+    prev->next = large->next;
+  else
+    heap_large_list = large->next;
+  vmm_release (kernel_pagemap, large->base);
+
+  heap_stats.large_count--;
+  heap_stats.large_pages -= large->pages;
+  cpu_irq_restore (flags);
+
+  kmem_cache_free (heap_large_cache, large);
+}
+
+/* Resize a large allocation by growing or shrinking its region, as long
+ * as that does not run into the guard page before the next one */
+static bool
+heap_large_resize (void *ptr, size_t size, size_t *old_size)
+{
+  uint64_t flags = cpu_irq_save ();
+  heap_large_t *prev;
+  heap_large_t *large = heap_large_find (ptr, &prev);
+  if (large == NULL)
+    {
+      panic ("heap: invalid pointer passed to krealloc");
+    }
+
+  size_t bytes = ALIGN_UP (size, PAGE_SIZE);
+  uintptr_t end = large->base + large->pages * PAGE_SIZE;
+  *old_size = large->pages * PAGE_SIZE;
+
+  bool resized = true;
+  if (size > KERNEL_LARGE_SIZE)
+    {
+      resized = false;
+    }
+  else if (bytes > *old_size
+           && heap_large_limit (large) - end < bytes - *old_size)
+    {
+      resized = false;
+    }
+  else if (bytes != *old_size)
+    {
+      resized = vmm_resize (kernel_pagemap, large->base, bytes);
+    }
+
+  if (resized)
+    {
+      heap_stats.large_pages -= large->pages;
+      large->pages = bytes / PAGE_SIZE;
+      heap_stats.large_pages += large->pages;
+    }
+  cpu_irq_restore (flags);
+
+  return resized;
+}
+
+static void *
+heap_kmalloc (size_t size)
 {
   if (size == 0)
     {
       return NULL;
     }
 
-  size_t total_size = ALIGN_UP_HEAP (size + sizeof (size_t));
-  if (total_size < MIN_ALLOC_SIZE)
+  /* Small requests are O(1) in the slab layer, the TLSF heap only deals
+   * with what is left */
+  if (size <= SLAB_MAX_SIZE)
     {
-      total_size = MIN_ALLOC_SIZE;
+      return slab_alloc (size);
+    }
+
+  if (size >= HEAP_LARGE_MIN)
+    {
+      return heap_large_alloc (size, PAGE_SIZE);
+    }
+
+  uint64_t flags = cpu_irq_save ();
+  void *ptr = heap_alloc (heap_request_size (size));
+  cpu_irq_restore (flags);
+
+  if (ptr == NULL)
+    {
+      printk ("heap: out of heap memory\n");
+    }
+  return ptr;
+}
+
+static void
+heap_kfree (void *ptr)
+{
+  if (ptr == NULL)
+    return;
+
+  if (heap_large_owns (ptr))
+    {
+      heap_large_free (ptr);
+      return;
     }
+  if (!heap_owns (ptr))
+    {
+      slab_free (ptr);
+      return;
+    }
+
+  heap_free_block_t *block = heap_payload_block (ptr);
+  if (((uintptr_t)ptr % HEAP_ALIGNMENT) != 0 || heap_block_is_free (block)
+      || heap_block_size (block) < MIN_ALLOC_SIZE
+      || (uintptr_t)heap_block_next (block) > (uintptr_t)heap_sentinel
+      || heap_block_next (block)->prev_phys != block)
+    {
+      panic ("heap: invalid pointer or heap corruption detected in kfree");
+      return;
+    }
+
+  uint64_t flags = cpu_irq_save ();
+
+  block = heap_block_release (block);
+  if (heap_block_next (block) == heap_sentinel
+      && heap_block_size (block) > HEAP_TRIM_THRESHOLD)
+    {
+      heap_trim (block);
+    }
+
+  cpu_irq_restore (flags);
+}
 
-  heap_free_block_t *prev = NULL;
-  heap_free_block_t *curr = free_list_head;
+/* Try to resize a heap block without moving it: shrinking splits off the
+ * tail, growing absorbs the free block right after it (growing the heap
+ * first if the block is at its end). */
+static bool
+heap_resize_in_place (void *ptr, size_t size)
+{
+  heap_free_block_t *block = heap_payload_block (ptr);
+  size_t total_size = heap_request_size (size);
 
-  while (curr != NULL)
+  if (total_size > heap_block_size (block))
     {
-      if (curr->size >= total_size)
+      heap_free_block_t *next = heap_block_next (block);
+      size_t available = heap_block_size (block);
+      if (heap_block_is_free (next))
         {
-          if (curr->size - total_size >= MIN_ALLOC_SIZE)
+          available += heap_block_size (next) + HEAP_HEADER_SIZE;
+          if (available < total_size
+              && heap_block_next (next) == heap_sentinel)
             {
-              heap_free_block_t *new_block
-                  = (heap_free_block_t *)((uintptr_t)curr + total_size);
-              new_block->size = curr->size - total_size;
-              new_block->next = curr->next;
-
-              curr->size = total_size;
-
-              if (prev == NULL)
-                {
-                  free_list_head = new_block;
-                }
-              else
-                {
-                  prev->next = new_block;
-                }
+              if (!heap_grow (total_size - available))
+                return false;
+              /* The new space merged into `next' */
+              available = heap_block_size (block) + heap_block_size (next)
+                          + HEAP_HEADER_SIZE;
             }
-          else
+        }
+      else if (next == heap_sentinel)
+        {
+          if (!heap_grow (total_size - available + HEAP_HEADER_SIZE))
+            return false;
+          next = heap_block_next (block);
+          available += heap_block_size (next) + HEAP_HEADER_SIZE;
+        }
+
+      if (available < total_size)
+        return false;
+
+      heap_list_remove (next);
+      block->size = available;
+      heap_block_next (block)->prev_phys = block;
+    }
+
+  heap_block_split (block, total_size);
+  return true;
+}
+
+static void *
+heap_krealloc (void *ptr, size_t size)
+{
+  if (ptr == NULL)
+    {
+      return heap_kmalloc (size);
+    }
+  if (size == 0)
+    {
+      heap_kfree (ptr);
+      return NULL;
+    }
+
+  size_t old_size;
+  if (heap_large_owns (ptr))
+    {
+      if (heap_large_resize (ptr, size, &old_size))
+        {
+          heap_stats.krealloc_in_place++;
+          return ptr;
+        }
+    }
+  else if (heap_owns (ptr))
+    {
+      if (size > SLAB_MAX_SIZE && size < HEAP_LARGE_MIN)
+        {
+          uint64_t flags = cpu_irq_save ();
+          bool resized = heap_resize_in_place (ptr, size);
+          cpu_irq_restore (flags);
+          if (resized)
             {
-              if (prev == NULL)
-                {
-                  free_list_head = curr->next;
-                }
-              else
-                {
-                  prev->next = curr->next;
-                }
+              heap_stats.krealloc_in_place++;
+              return ptr;
             }
+        }
+      old_size = heap_block_size (heap_payload_block (ptr));
+    }
+  else
+    {
+      old_size = slab_size (ptr);
+      if (size <= old_size)
+        {
+          heap_stats.krealloc_in_place++;
+          return ptr;
+        }
+    }
+
+  void *new_ptr = heap_kmalloc (size);
+  if (new_ptr)
+    {
+      memcpy (new_ptr, ptr, size < old_size ? size : old_size);
+      heap_kfree (ptr);
+      heap_stats.krealloc_moved++;
+    }
+  return new_ptr;
+}
+
+static void *
+heap_kmalloc_aligned (size_t size, size_t align)
+{
+  if (size == 0 || align == 0 || (align & (align - 1)) != 0)
+    {
+      return NULL;
+    }
+  if (align <= HEAP_ALIGNMENT)
+    {
+      return heap_kmalloc (size);
+    }
+  if (align >= PAGE_SIZE || size >= HEAP_LARGE_MIN)
+    {
+      return heap_large_alloc (size, align < PAGE_SIZE ? PAGE_SIZE : align);
+    }
+
+  /* The slab layer can't align beyond its object size, so this always
+   * goes to the TLSF heap */
+  uint64_t flags = cpu_irq_save ();
+  void *ptr = heap_alloc_aligned (heap_request_size (size), align);
+  cpu_irq_restore (flags);
+
+  if (ptr == NULL)
+    {
+      printk ("heap: out of heap memory\n");
+    }
+  return ptr;
+}
 
-          size_t *size_ptr = (size_t *)curr;
-          *size_ptr = curr->size;
+#ifdef KMEM_TRACK
+/* Allocation tracking, enabled by building with -DKMEM_TRACK (see
+ * usr/share/os.mk). Every allocation gets a small header naming the tag of
+ * its call site, and every tag counts the live bytes and objects of its
+ * site. Sites are resolved to symbols when /dev/kmemstat is read. */
 
-          void *user_ptr = (void *)((uintptr_t)curr + sizeof (size_t));
+#define KMEM_TRACK_MAGIC 0x6B6D
+#define KMEM_TRACK_TAGS 256
 
-          return user_ptr;
+/* For aligned allocations the header sits right before the aligned
+ * pointer, `offset' bytes into the block */
+typedef struct
+{
+  uint16_t magic;
+  uint16_t tag;
+  uint32_t offset;
+  uint64_t size;
+} kmem_track_header_t;
+
+typedef struct
+{
+  uintptr_t site;
+  uint64_t live_bytes;
+  uint64_t live_count;
+  uint64_t allocs;
+} kmem_tag_t;
+
+/* Tag 0 collects the sites that found the table full */
+static kmem_tag_t kmem_tags[KMEM_TRACK_TAGS];
+
+static uint32_t
+kmem_tag_lookup (uintptr_t site)
+{
+  uint32_t slot = ((site >> 4) * 0x9E3779B97F4A7C15ull) >> 56;
+  for (int i = 0; i < KMEM_TRACK_TAGS - 1; i++)
+    {
+      uint32_t tag = (slot + i) % (KMEM_TRACK_TAGS - 1) + 1;
+      if (kmem_tags[tag].site == site)
+        return tag;
+      if (kmem_tags[tag].site == 0)
+        {
+          kmem_tags[tag].site = site;
+          return tag;
         }
-      prev = curr;
-      curr = curr->next;
     }
+  return 0;
+}
 
-  printk ("heap: out of heap memory\n");
-  return NULL;
+static void *
+kmem_track_tag (void *raw, size_t offset, size_t size, void *site)
+{
+  uint64_t flags = cpu_irq_save ();
+  kmem_track_header_t *header
+      = (kmem_track_header_t *)((uintptr_t)raw + offset);
+  header->magic = KMEM_TRACK_MAGIC;
+  header->tag = kmem_tag_lookup ((uintptr_t)site);
+  header->offset = offset;
+  header->size = size;
+
+  kmem_tag_t *tag = &kmem_tags[header->tag];
+  tag->live_bytes += size;
+  tag->live_count++;
+  tag->allocs++;
+  cpu_irq_restore (flags);
+
+  return (void *)((uintptr_t)header + sizeof (kmem_track_header_t));
 }
 
-void
-kfree (void *ptr)
+static kmem_track_header_t *
+kmem_track_header (void *ptr)
 {
-  if (ptr == NULL)
-    return;
+  kmem_track_header_t *header
+      = (kmem_track_header_t *)((uintptr_t)ptr - sizeof (kmem_track_header_t));
+  if (header->magic != KMEM_TRACK_MAGIC || header->tag >= KMEM_TRACK_TAGS)
+    {
+      panic ("heap: untracked pointer or heap corruption detected");
+    }
+  return header;
+}
+
+/* Drop the tag of `ptr' and return the start of its block */
+static void *
+kmem_track_untag (void *ptr)
+{
+  kmem_track_header_t *header = kmem_track_header (ptr);
 
-  size_t *size_ptr = (size_t *)((uintptr_t)ptr - sizeof (size_t));
-  void *block_start = (void *)size_ptr;
-  size_t block_size = *size_ptr;
+  uint64_t flags = cpu_irq_save ();
+  kmem_tag_t *tag = &kmem_tags[header->tag];
+  tag->live_bytes -= header->size;
+  tag->live_count--;
+  header->magic = 0;
+  cpu_irq_restore (flags);
 
-  if ((uintptr_t)block_start < (uintptr_t)heap_start
-      || (uintptr_t)block_start >= (uintptr_t)heap_start + heap_size
-      || block_size < MIN_ALLOC_SIZE
-      || ((uintptr_t)block_start % HEAP_ALIGNMENT) != 0)
+  return (void *)((uintptr_t)header - header->offset);
+}
+
+static void *
+kmem_track_alloc (size_t size, void *site)
+{
+  if (size == 0 || size > KERNEL_HEAP_MAX_SIZE)
     {
-      panic ("heap: invalid pointer or heap corruption detected in kfree");
-      return;
+      return NULL;
+    }
+  void *raw = heap_kmalloc (size + sizeof (kmem_track_header_t));
+  if (raw == NULL)
+    {
+      return NULL;
+    }
+  return kmem_track_tag (raw, 0, size, site);
+}
+
+/* Aligned allocations spend a whole `align' on the header */
+static void *
+kmem_track_alloc_aligned (size_t size, size_t align, void *site)
+{
+  if (align <= HEAP_ALIGNMENT)
+    {
+      return kmem_track_alloc (size, site);
+    }
+  if (size == 0 || size > KERNEL_LARGE_SIZE || align > UINT32_MAX)
+    {
+      return NULL;
+    }
+  void *raw = heap_kmalloc_aligned (size + align, align);
+  if (raw == NULL)
+    {
+      return NULL;
+    }
+  return kmem_track_tag (raw, align - sizeof (kmem_track_header_t), size,
+                         site);
+}
+
+static void *
+kmem_track_realloc (void *ptr, size_t size, void *site)
+{
+  if (ptr == NULL)
+    {
+      return kmem_track_alloc (size, site);
+    }
+  if (size == 0 || size > KERNEL_HEAP_MAX_SIZE)
+    {
+      if (size == 0)
+        {
+          heap_kfree (kmem_track_untag (ptr));
+        }
+      return NULL;
     }
 
-  heap_free_block_t *prev = NULL;
-  heap_free_block_t *curr = free_list_head;
+  kmem_track_header_t *header = kmem_track_header (ptr);
+  size_t old_size = header->size;
+  if (header->offset != 0)
+    {
+      /* Like the untracked krealloc, the alignment is not kept */
+      void *new_ptr = kmem_track_alloc (size, site);
+      if (new_ptr)
+        {
+          memcpy (new_ptr, ptr, size < old_size ? size : old_size);
+          heap_kfree (kmem_track_untag (ptr));
+        }
+      return new_ptr;
+    }
 
-  while (curr != NULL && (uintptr_t)curr < (uintptr_t)block_start)
+  /* Untag first; if the resize fails the block is tagged again as is */
+  void *raw = kmem_track_untag (ptr);
+  void *new_raw = heap_krealloc (raw, size + sizeof (kmem_track_header_t));
+  if (new_raw == NULL)
     {
-      prev = curr;
-      curr = curr->next;
+      kmem_track_tag (raw, 0, old_size, site);
+      return NULL;
     }
+  return kmem_track_tag (new_raw, 0, size, site);
+}
+#endif
+
+#ifdef KMEM_TRACE
+/* Allocation trace, enabled by building with -DKMEM_TRACE (see
+ * usr/share/os.mk). Every call into the allocator is logged to a ring that
+ * /dev/kmemtrace drains, in the text format tools/heapbench replays. When
+ * the ring is full new records are dropped and counted. */
 
-  heap_free_block_t *freed_block = (heap_free_block_t *)block_start;
-  freed_block->size = block_size;
+#define KMEM_TRACE_RECORDS 4096
 
-  if (prev == NULL)
+typedef struct
+{
+  char op;
+  uint64_t ptr;
+  uint64_t old;
+  uint64_t size;
+  uint64_t align;
+} kmem_trace_record_t;
+
+static kmem_trace_record_t kmem_trace_ring[KMEM_TRACE_RECORDS];
+static uint64_t kmem_trace_head = 0;
+static uint64_t kmem_trace_tail = 0;
+static uint64_t kmem_trace_dropped = 0;
+
+static void
+kmem_trace (char op, void *ptr, void *old, size_t size, size_t align)
+{
+  uint64_t flags = cpu_irq_save ();
+  if (kmem_trace_head - kmem_trace_tail == KMEM_TRACE_RECORDS)
     {
-      freed_block->next = free_list_head;
-      free_list_head = freed_block;
+      kmem_trace_dropped++;
     }
   else
     {
-      freed_block->next = prev->next;
-      prev->next = freed_block;
+      kmem_trace_record_t *record
+          = &kmem_trace_ring[kmem_trace_head % KMEM_TRACE_RECORDS];
+      record->op = op;
+      record->ptr = (uintptr_t)ptr;
+      record->old = (uintptr_t)old;
+      record->size = size;
+      record->align = align;
+      kmem_trace_head++;
+    }
+  cpu_irq_restore (flags);
+}
+
+int
+kmemtrace_read (char *data, void *buffer, int size)
+{
+  (void)data; /* unused */
+  char *buf = buffer;
+  char line[80];
+  int len = 0;
+
+  uint64_t flags = cpu_irq_save ();
+  if (kmem_trace_dropped)
+    {
+      int n = snprintf (line, sizeof (line), "# dropped %llu\n",
+                        kmem_trace_dropped);
+      if (n < size)
+        {
+          memcpy (buf, line, n);
+          len = n;
+          kmem_trace_dropped = 0;
+        }
+    }
+
+  while (kmem_trace_tail != kmem_trace_head)
+    {
+      kmem_trace_record_t *record
+          = &kmem_trace_ring[kmem_trace_tail % KMEM_TRACE_RECORDS];
+      int n;
+      switch (record->op)
+        {
+        case 'r':
+          n = snprintf (line, sizeof (line), "r %llx %llx %llu\n",
+                        record->old, record->ptr, record->size);
+          break;
+        case 'm':
+          n = snprintf (line, sizeof (line), "m %llx %llu %llu\n",
+                        record->ptr, record->size, record->align);
+          break;
+        case 'f':
+          n = snprintf (line, sizeof (line), "f %llx\n", record->ptr);
+          break;
+        default:
+          n = snprintf (line, sizeof (line), "a %llx %llu\n", record->ptr,
+                        record->size);
+          break;
+        }
+      if (len + n > size)
+        break;
+      memcpy (buf + len, line, n);
+      len += n;
+      kmem_trace_tail++;
+    }
+  cpu_irq_restore (flags);
+
+  return len;
+}
+
+fs_operations_t kmemtrace_ops = {
+  .read = kmemtrace_read,
+};
+#else
+static inline void
+kmem_trace (char op, void *ptr, void *old, size_t size, size_t align)
+{
+  (void)op;
+  (void)ptr;
+  (void)old;
+  (void)size;
+  (void)align;
+}
+#endif
+
+void *
+kmalloc (size_t size)
+{
+#ifdef KMEM_TRACK
+  void *ptr = kmem_track_alloc (size, __builtin_return_address (0));
+#else
+  void *ptr = heap_kmalloc (size);
+#endif
+  if (ptr)
+    {
+      kmem_trace ('a', ptr, NULL, size, 0);
     }
+  return ptr;
+}
 
-  if (freed_block->next != NULL
-      && (uintptr_t)freed_block + freed_block->size
-             == (uintptr_t)freed_block->next)
+void *
+kmalloc_aligned (size_t size, size_t align)
+{
+#ifdef KMEM_TRACK
+  void *ptr = kmem_track_alloc_aligned (size, align,
+                                        __builtin_return_address (0));
+#else
+  void *ptr = heap_kmalloc_aligned (size, align);
+#endif
+  if (ptr)
     {
-      freed_block->size += freed_block->next->size;
-      freed_block->next = freed_block->next->next;
+      kmem_trace ('m', ptr, NULL, size, align);
     }
+  return ptr;
+}
 
-  if (prev != NULL && (uintptr_t)prev + prev->size == (uintptr_t)freed_block)
+void
+kfree (void *ptr)
+{
+  if (ptr == NULL)
     {
-      prev->size += freed_block->size;
-      prev->next = freed_block->next;
+      return;
     }
+  kmem_trace ('f', ptr, NULL, 0, 0);
+#ifdef KMEM_TRACK
+  ptr = kmem_track_untag (ptr);
+#endif
+  heap_kfree (ptr);
 }
 
 void *
@@ -194,10 +1196,15 @@ kcalloc (size_t num, size_t size)
     {
       return NULL;
     }
-  void *ptr = kmalloc (total);
+#ifdef KMEM_TRACK
+  void *ptr = kmem_track_alloc (total, __builtin_return_address (0));
+#else
+  void *ptr = heap_kmalloc (total);
+#endif
   if (ptr)
     {
       memset (ptr, 0, total);
+      kmem_trace ('a', ptr, NULL, total, 0);
     }
   return ptr;
 }
@@ -205,28 +1212,128 @@ kcalloc (size_t num, size_t size)
 void *
 krealloc (void *ptr, size_t size)
 {
-  if (ptr == NULL)
+#ifdef KMEM_TRACK
+  void *new_ptr = kmem_track_realloc (ptr, size, __builtin_return_address (0));
+#else
+  void *new_ptr = heap_krealloc (ptr, size);
+#endif
+  if (new_ptr != NULL || size == 0)
     {
-      return kmalloc (size);
+      kmem_trace ('r', new_ptr, ptr, size, 0);
     }
-  if (size == 0)
+  return new_ptr;
+}
+
+void
+heap_get_stats (heap_stats_t *stats)
+{
+  *stats = heap_stats;
+}
+
+/* Sum up the TLSF free lists, per first level list into `counts' and
+ * `bytes' */
+static void
+heap_walk_free (heap_usage_t *usage, uint64_t *counts, uint64_t *bytes)
+{
+  usage->mapped = heap_size;
+  usage->free = 0;
+  usage->largest = 0;
+  usage->free_blocks = 0;
+
+  for (int fl = 0; fl < HEAP_FL_COUNT; fl++)
     {
-      kfree (ptr);
-      return NULL;
+      for (int sl = 0; sl < HEAP_SL_COUNT; sl++)
+        {
+          for (heap_free_block_t *block = heap_free_lists[fl][sl]; block;
+               block = block->next)
+            {
+              size_t block_size = heap_block_size (block);
+              counts[fl]++;
+              bytes[fl] += block_size;
+              usage->free += block_size;
+              usage->free_blocks++;
+              if (block_size > usage->largest)
+                usage->largest = block_size;
+            }
+        }
     }
+}
 
-  size_t old_size
-      = *((size_t *)((uintptr_t)ptr - sizeof (size_t))) - sizeof (size_t);
-  if (size <= old_size)
+void
+heap_get_usage (heap_usage_t *usage)
+{
+  uint64_t counts[HEAP_FL_COUNT] = { 0 };
+  uint64_t bytes[HEAP_FL_COUNT] = { 0 };
+
+  uint64_t flags = cpu_irq_save ();
+  heap_walk_free (usage, counts, bytes);
+  cpu_irq_restore (flags);
+}
+
+/* /dev/kmemstat: heap size, a histogram of the free blocks by power of two
+ * (the TLSF first level) and, with KMEM_TRACK, live memory per call site */
+int
+kmemstat_read (char *data, void *buffer, int size)
+{
+  (void)data; /* unused */
+  char *buf = buffer;
+  int len = 0;
+
+  uint64_t counts[HEAP_FL_COUNT] = { 0 };
+  uint64_t bytes[HEAP_FL_COUNT] = { 0 };
+  heap_usage_t usage;
+
+  uint64_t flags = cpu_irq_save ();
+  heap_walk_free (&usage, counts, bytes);
+  heap_stats_t stats = heap_stats;
+  cpu_irq_restore (flags);
+
+  len += snprintf (buf + len, size - len,
+                   "heap %llu free %llu largest %llu\n", usage.mapped,
+                   usage.free, usage.largest);
+  len += snprintf (buf + len, size - len, "large %llu pages %llu\n",
+                   stats.large_count, stats.large_pages);
+  len += snprintf (buf + len, size - len, "krealloc in-place %llu moved %llu\n",
+                   stats.krealloc_in_place, stats.krealloc_moved);
+  len += snprintf (buf + len, size - len, "free blocks (from bytes):\n");
+  for (int fl = 0; fl < HEAP_FL_COUNT && len < size; fl++)
     {
-      return ptr;
+      if (counts[fl] == 0)
+        continue;
+      uint64_t from = fl ? 1ull << (fl + HEAP_FL_SHIFT - 1) : 0;
+      len += snprintf (buf + len, size - len, "  %llu: %llu blocks %llu\n",
+                       from, counts[fl], bytes[fl]);
     }
 
-  void *new_ptr = kmalloc (size);
-  if (new_ptr)
+#ifdef KMEM_TRACK
+  len += snprintf (buf + len, size - len,
+                   "call sites (live bytes, live objects, allocations):\n");
+  for (int i = 0; i < KMEM_TRACK_TAGS && len < size; i++)
     {
-      memcpy (new_ptr, ptr, old_size);
-      kfree (ptr);
+      kmem_tag_t *tag = &kmem_tags[i];
+      if (tag->allocs == 0)
+        continue;
+
+      const struct ksym *sym = i ? odb_addr_to_sym (tag->site) : NULL;
+      if (sym)
+        {
+          len += snprintf (buf + len, size - len,
+                           "  %s+%llu: %llu %llu %llu\n", sym->name,
+                           (uint64_t)(tag->site - sym->addr),
+                           tag->live_bytes, tag->live_count, tag->allocs);
+        }
+      else
+        {
+          len += snprintf (buf + len, size - len,
+                           "  %llx: %llu %llu %llu\n", (uint64_t)tag->site,
+                           tag->live_bytes, tag->live_count, tag->allocs);
+        }
     }
-  return new_ptr;
+#endif
+
+  return len;
 }
+
+fs_operations_t kmemstat_ops = {
+  .read = kmemstat_read,
+};
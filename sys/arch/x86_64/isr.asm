@@ -61,6 +61,8 @@ isr_common_stub:
     push r15
 
     mov rdi, rsp
+    ; C code expects DF clear, we may have interrupted memmove()
+    cld
     call isr_handler_c
 
     pop r15
@@ -100,6 +102,8 @@ irq_common_stub:
     push r15
 
     mov rdi, rsp
+    ; C code expects DF clear, we may have interrupted memmove()
+    cld
     call irq_handler_c
 
     pop r15
@@ -142,4 +146,5 @@ ISR_ERR   17, 17
 ISR_NOERR 18, 18
 
 IRQ 0, 32
-IRQ 1, 33
\ No newline at end of file
+IRQ 1, 33
+IRQ 4, 36
\ No newline at end of file
@@ -29,11 +29,14 @@
 #include <sys/printk.h>
 #include <sys/string.h>
 #include <sys/tar/tar_parse.h>
+#include <x86_64/cpu.h>
+#include <x86_64/fpu.h>
 #include <x86_64/heap.h>
 #include <x86_64/page.h>
 #include <x86_64/request.h>
 #include <x86_64/vmm/vmm_map.h>
 #include <random.h>
+#include <uart.h>
 #include <sys/devfs/devfs_dev.h>
 #include <sys/module.h>
 #include <sys/printk.h>
@@ -58,13 +61,19 @@ x64_main ()
   liminefb_init ();
   trap_init ();
   asm volatile ("cli");
+  cpu_init ();
   pmm_init ();
   vmm_init ();
   heap_init ();
+  liminefb_shadow_init ();
+  fpu_init ();
   proc_init ();
   atkbd_init ();
+  uart_init ();
   asm volatile("sti");
+  vfs_init ();
   module_init ();
+  pmm_reclaim_bootloader ();
   devfs_init ();
   random_init ();
 
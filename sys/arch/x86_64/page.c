@@ -6,6 +6,7 @@
  */
 
 #include <limine.h>
+#include <x86_64/cpu.h>
 #include <x86_64/page.h>
 #include <x86_64/request.h>
 #include <x86_64/vmm/vmm_map.h>
@@ -18,18 +19,263 @@ extern uint8_t _rodata_start[], _rodata_end[];
 extern uint8_t _data_start[], _data_end[];
 extern uint8_t _bss_start[], _bss_end[];
 
-#define PMM_BITMAP_SIZE (1024 * 1024)
-static uint8_t memory_bitmap[PMM_BITMAP_SIZE];
+/* The page bitmap has one bit per physical page (set = used). On top of it
+ * sit two summary levels: a bit in summary_bitmap is set while the matching
+ * 64-bit bitmap word still has a free page, and a bit in top_bitmap is set
+ * while the matching summary word is non-zero. This lets allocate_page() find
+ * a free page with a couple of bit scans instead of walking the bitmap.
+ *
+ * All three are sized from the highest usable address at boot and live in
+ * usable RAM (reached through the HHDM), see pmm_init(). */
+static uint64_t *memory_bitmap = NULL;
+static uint64_t *summary_bitmap = NULL;
+static uint64_t *top_bitmap = NULL;
+static size_t bitmap_words = 0;
+static size_t summary_words = 0;
+static size_t top_words = 0;
+
+/* Number of mappings of each allocated page, so that pages shared between
+ * address spaces (copy-on-write) are only freed with their last user. Lives
+ * right after the bitmaps. */
+static uint16_t *page_refcounts = NULL;
+
+/* Next-fit cursor: the bitmap word the last allocation came from */
+static size_t next_fit_word = 0;
 
 static size_t highest_page = 0;
 static size_t used_pages = 0;
-static size_t free_pages = 0;
+static size_t free_page_count = 0;
 static size_t total_ram_pages = 0;
 
-#define BITMAP_GET(index) (memory_bitmap[(index) / 8] & (1 << ((index) % 8)))
-#define BITMAP_SET(index) (memory_bitmap[(index) / 8] |= (1 << ((index) % 8)))
-#define BITMAP_CLEAR(index)                                                    \
-  (memory_bitmap[(index) / 8] &= ~(1 << ((index) % 8)))
+#define BITMAP_GET(index)                                                      \
+  (memory_bitmap[(index) / 64] & (1ull << ((index) % 64)))
+
+/* Mark a page as used and drop the summary bits once its word fills up */
+static void
+pmm_bitmap_set (size_t index)
+{
+  size_t word = index / 64;
+  memory_bitmap[word] |= 1ull << (index % 64);
+  if (memory_bitmap[word] != ~0ull)
+    return;
+
+  size_t summary = word / 64;
+  summary_bitmap[summary] &= ~(1ull << (word % 64));
+  if (summary_bitmap[summary] == 0)
+    top_bitmap[summary / 64] &= ~(1ull << (summary % 64));
+}
+
+/* Mark a page as free and advertise its word in the summary levels */
+static void
+pmm_bitmap_clear (size_t index)
+{
+  size_t word = index / 64;
+  size_t summary = word / 64;
+  memory_bitmap[word] &= ~(1ull << (index % 64));
+  summary_bitmap[summary] |= 1ull << (word % 64);
+  top_bitmap[summary / 64] |= 1ull << (summary % 64);
+}
+
+/* Find the first bitmap word at or after `from' that still has a free page.
+ * Returns (size_t)-1 if there is none. */
+static size_t
+pmm_find_free_word (size_t from)
+{
+  size_t summary = from / 64;
+  if (summary >= summary_words)
+    return (size_t)-1;
+
+  uint64_t bits = summary_bitmap[summary] & (~0ull << (from % 64));
+  if (bits)
+    return summary * 64 + __builtin_ctzll (bits);
+
+  summary++;
+  size_t top = summary / 64;
+  if (top >= top_words)
+    return (size_t)-1;
+
+  bits = top_bitmap[top] & (~0ull << (summary % 64));
+  for (;;)
+    {
+      if (bits)
+        {
+          summary = top * 64 + __builtin_ctzll (bits);
+          return summary * 64 + __builtin_ctzll (summary_bitmap[summary]);
+        }
+      if (++top >= top_words)
+        return (size_t)-1;
+      bits = top_bitmap[top];
+    }
+}
+
+/* Buddy allocator for physically contiguous allocations. Every free page is
+ * part of exactly one naturally aligned free block of 2^order pages. A block
+ * is linked into buddy_free_lists[order] through a header stored in its first
+ * page (reached through the HHDM). The header is only trusted while the page
+ * is also free in the bitmap, which stays the authoritative view. */
+#define PMM_BUDDY_MAGIC 0x6275646479626c6bull
+
+typedef struct pmm_buddy_block
+{
+  uint64_t magic;
+  size_t order;
+  struct pmm_buddy_block *prev;
+  struct pmm_buddy_block *next;
+} pmm_buddy_block_t;
+
+static pmm_buddy_block_t *buddy_free_lists[PMM_MAX_ORDER + 1];
+
+static pmm_buddy_block_t *
+buddy_block (size_t pfn)
+{
+  return (pmm_buddy_block_t *)(pfn * PAGE_SIZE + VMM_HIGHER_HALF);
+}
+
+static size_t
+buddy_block_pfn (pmm_buddy_block_t *block)
+{
+  return ((uintptr_t)block - VMM_HIGHER_HALF) / PAGE_SIZE;
+}
+
+/* Check whether pfn is the head of a free block of the given order */
+static bool
+buddy_is_free_head (size_t pfn, size_t order)
+{
+  if (pfn + (1ul << order) - 1 > highest_page || BITMAP_GET (pfn))
+    return false;
+
+  pmm_buddy_block_t *block = buddy_block (pfn);
+  return block->magic == (PMM_BUDDY_MAGIC ^ pfn) && block->order == order;
+}
+
+static void
+buddy_push (size_t pfn, size_t order)
+{
+  pmm_buddy_block_t *block = buddy_block (pfn);
+  block->magic = PMM_BUDDY_MAGIC ^ pfn;
+  block->order = order;
+  block->prev = NULL;
+  block->next = buddy_free_lists[order];
+  if (block->next)
+    block->next->prev = block;
+  buddy_free_lists[order] = block;
+}
+
+static void
+buddy_unlink (size_t pfn)
+{
+  pmm_buddy_block_t *block = buddy_block (pfn);
+  if (block->prev)
+    block->prev->next = block->next;
+  else
+    buddy_free_lists[block->order] = block->next;
+  if (block->next)
+    block->next->prev = block->prev;
+  block->magic = 0;
+}
+
+/* Give a block back to the free lists, merging it with its buddy for as long
+ * as the buddy is free too */
+static void
+buddy_insert (size_t pfn, size_t order)
+{
+  while (order < PMM_MAX_ORDER)
+    {
+      size_t buddy = pfn ^ (1ul << order);
+      if (!buddy_is_free_head (buddy, order))
+        break;
+      buddy_unlink (buddy);
+      pfn &= ~(1ul << order);
+      order++;
+    }
+  buddy_push (pfn, order);
+}
+
+/* Split the block headed by pfn down to `order', returning the upper halves
+ * to the free lists. The block must already be unlinked. */
+static void
+buddy_split (size_t pfn, size_t from_order, size_t order)
+{
+  while (from_order > order)
+    {
+      from_order--;
+      buddy_push (pfn + (1ul << from_order), from_order);
+    }
+}
+
+/* Carve a single page out of whichever free block currently contains it.
+ * Used when the bitmap picked the page for allocate_page(). */
+static void
+buddy_take_page (size_t pfn)
+{
+  for (size_t order = 0; order <= PMM_MAX_ORDER; order++)
+    {
+      size_t head = pfn & ~((1ul << order) - 1);
+      if (!buddy_is_free_head (head, order))
+        continue;
+
+      buddy_unlink (head);
+      while (order > 0)
+        {
+          order--;
+          size_t half = 1ul << order;
+          if (pfn >= head + half)
+            {
+              buddy_push (head, order);
+              head += half;
+            }
+          else
+            {
+              buddy_push (head + half, order);
+            }
+        }
+      return;
+    }
+
+  panic ("pmm: free page is not covered by any buddy block");
+}
+
+/* Add a run of free pages to the buddy free lists */
+static void
+buddy_add_range (size_t pfn, size_t count)
+{
+  while (count > 0)
+    {
+      size_t order = pfn ? (size_t)__builtin_ctzl (pfn) : PMM_MAX_ORDER;
+      if (order > PMM_MAX_ORDER)
+        order = PMM_MAX_ORDER;
+      while ((1ul << order) > count)
+        order--;
+
+      buddy_insert (pfn, order);
+      pfn += 1ul << order;
+      count -= 1ul << order;
+    }
+}
+
+/* Pages that have already been zeroed by the idle loop. They are marked used
+ * in the bitmap, but count as free memory in the statistics. */
+#define PMM_ZERO_POOL_SIZE 64
+
+static uintptr_t zero_pool[PMM_ZERO_POOL_SIZE];
+static size_t zero_pool_count = 0;
+
+/* Hand the pre-zeroed pages back to the bitmap and the buddy free lists, for
+ * when those run dry. Called with interrupts disabled. */
+static void
+pmm_drain_zero_pool ()
+{
+  while (zero_pool_count > 0)
+    {
+      size_t index = zero_pool[--zero_pool_count] / PAGE_SIZE;
+      pmm_bitmap_clear (index);
+      page_refcounts[index] = 0;
+      buddy_block (index)->magic = 0;
+      buddy_insert (index, 0);
+      used_pages--;
+      free_page_count++;
+    }
+}
 
 /* Get the total size of manageable physical memory */
 size_t
@@ -42,7 +288,7 @@ get_total_memory ()
 size_t
 get_used_memory ()
 {
-  size_t used = used_pages;
+  size_t used = used_pages - zero_pool_count;
   return used * PAGE_SIZE;
 }
 
@@ -50,14 +296,22 @@ get_used_memory ()
 size_t
 get_free_memory ()
 {
-  size_t free_count = free_pages;
+  size_t free_count = free_page_count + zero_pool_count;
   return free_count * PAGE_SIZE;
 }
 
+uintptr_t hhdm_offset = 0;
+
 /* Initialize the physical memory manager */
 void
 pmm_init ()
 {
+  if (hhdm_request.response == NULL)
+    {
+      panic ("Could not acquire hhdm response");
+    }
+  hhdm_offset = hhdm_request.response->offset;
+
   if (memmap_request.response == NULL)
     {
       panic ("Could not acquire memory map response");
@@ -73,6 +327,10 @@ pmm_init ()
   for (size_t i = 0; i < entry_count; i++)
     {
       struct limine_memmap_entry *entry = entries[i];
+      if (entry->type != LIMINE_MEMMAP_USABLE
+          && entry->type != LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE)
+        continue;
+
       uintptr_t top = entry->base + entry->length;
       if (top > highest_addr)
         {
@@ -80,27 +338,64 @@ pmm_init ()
         }
     }
 
-  highest_page = highest_addr / PAGE_SIZE;
-
-  size_t max_bitmap_pages = PMM_BITMAP_SIZE * 8;
-  if (highest_page >= max_bitmap_pages)
+  if (highest_addr < PAGE_SIZE)
     {
-      // printk( "Warning: PMM bitmap capacity (%d MiB) exceeded. High memory (>
-      // %u GiB) may be unavailable.\n",
-      //        PMM_BITMAP_SIZE / (1024*1024),
-      //        (max_bitmap_pages * PAGE_SIZE) / (1024*1024*1024));
-      highest_page = max_bitmap_pages - 1;
+      panic ("pmm: no usable memory");
     }
+  highest_page = highest_addr / PAGE_SIZE - 1;
+
+  /* Size the metadata for exactly the memory we have and carve it out of
+   * the first usable region above 1 MiB that can hold it */
+  bitmap_words = highest_page / 64 + 1;
+  summary_words = (bitmap_words + 63) / 64;
+  top_words = (summary_words + 63) / 64;
+  size_t meta_size = ALIGN_UP (
+      (bitmap_words + summary_words + top_words) * sizeof (uint64_t)
+          + (highest_page + 1) * sizeof (uint16_t),
+      PAGE_SIZE);
+
+  uintptr_t meta_phys = 0;
+  for (size_t i = 0; i < entry_count; i++)
+    {
+      struct limine_memmap_entry *entry = entries[i];
+      if (entry->type != LIMINE_MEMMAP_USABLE)
+        continue;
+
+      uintptr_t base = ALIGN_UP (entry->base, PAGE_SIZE);
+      if (base < 0x100000)
+        base = 0x100000;
+      uintptr_t top = (entry->base + entry->length) & ~(PAGE_SIZE - 1);
+      if (top > base && top - base >= meta_size)
+        {
+          meta_phys = base;
+          break;
+        }
+    }
+  if (meta_phys == 0)
+    {
+      panic ("pmm: no usable region large enough for the page bitmap");
+    }
+
+  memory_bitmap = (uint64_t *)(meta_phys + VMM_HIGHER_HALF);
+  summary_bitmap = memory_bitmap + bitmap_words;
+  top_bitmap = summary_bitmap + summary_words;
+  page_refcounts = (uint16_t *)(top_bitmap + top_words);
 
-  memset (memory_bitmap, 0xFF, PMM_BITMAP_SIZE);
+  memset (memory_bitmap, 0xFF, bitmap_words * sizeof (uint64_t));
+  memset (summary_bitmap, 0, summary_words * sizeof (uint64_t));
+  memset (top_bitmap, 0, top_words * sizeof (uint64_t));
+  memset (page_refcounts, 0, (highest_page + 1) * sizeof (uint16_t));
+  next_fit_word = 0;
 
   total_ram_pages = 0;
   for (size_t i = 0; i < entry_count; i++)
     {
       struct limine_memmap_entry *entry = entries[i];
 
-      if (entry->type == LIMINE_MEMMAP_USABLE
-          || entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE)
+      /* Bootloader reclaimable memory still holds the memory map, the page
+       * tables we run on and the boot stack. It stays marked used until
+       * pmm_reclaim_bootloader(). */
+      if (entry->type == LIMINE_MEMMAP_USABLE)
         {
           uintptr_t base = ALIGN_UP (entry->base, PAGE_SIZE);
           uintptr_t top = (entry->base + entry->length) & ~(PAGE_SIZE - 1);
@@ -117,7 +412,7 @@ pmm_init ()
                 {
                   if (BITMAP_GET (page_idx))
                     {
-                      BITMAP_CLEAR (page_idx);
+                      pmm_bitmap_clear (page_idx);
                       total_ram_pages++;
                     }
                 }
@@ -125,7 +420,7 @@ pmm_init ()
         }
     }
 
-  free_pages = total_ram_pages;
+  free_page_count = total_ram_pages;
 
   struct limine_executable_address_response *kaddr
       = kernel_address_request.response;
@@ -144,30 +439,23 @@ pmm_init ()
         {
           if (!BITMAP_GET (page_idx))
             {
-              free_pages--;
+              free_page_count--;
             }
-          BITMAP_SET (page_idx);
+          pmm_bitmap_set (page_idx);
         }
     }
 
-  uintptr_t bitmap_virt_start = (uintptr_t)memory_bitmap;
-  uintptr_t bitmap_phys_start
-      = bitmap_virt_start - kaddr->virtual_base + kaddr->physical_base;
-  uintptr_t bitmap_phys_end = bitmap_phys_start + PMM_BITMAP_SIZE;
-  size_t bitmap_first_page = bitmap_phys_start / PAGE_SIZE;
-  size_t bitmap_last_page = (bitmap_phys_end + PAGE_SIZE - 1) / PAGE_SIZE;
+  size_t meta_first_page = meta_phys / PAGE_SIZE;
+  size_t meta_last_page = (meta_phys + meta_size) / PAGE_SIZE;
 
-  for (size_t page_idx = bitmap_first_page; page_idx < bitmap_last_page;
+  for (size_t page_idx = meta_first_page; page_idx < meta_last_page;
        ++page_idx)
     {
-      if (page_idx <= highest_page)
+      if (!BITMAP_GET (page_idx))
         {
-          if (!BITMAP_GET (page_idx))
-            {
-              free_pages--;
-            }
-          BITMAP_SET (page_idx);
+          free_page_count--;
         }
+      pmm_bitmap_set (page_idx);
     }
 
   size_t pages_below_1mb = 0x100000 / PAGE_SIZE;
@@ -177,37 +465,188 @@ pmm_init ()
         {
           if (!BITMAP_GET (page_idx))
             {
-              free_pages--;
+              free_page_count--;
             }
-          BITMAP_SET (page_idx);
+          pmm_bitmap_set (page_idx);
         }
     }
 
-  used_pages = total_ram_pages - free_pages;
+  used_pages = total_ram_pages - free_page_count;
+
+  for (size_t order = 0; order <= PMM_MAX_ORDER; order++)
+    buddy_free_lists[order] = NULL;
+
+  size_t run_start = 0;
+  size_t run_length = 0;
+  for (size_t page_idx = 0; page_idx <= highest_page; ++page_idx)
+    {
+      if (!BITMAP_GET (page_idx))
+        {
+          /* Boot-time page contents are arbitrary, make sure nothing looks
+           * like a stale free block header */
+          buddy_block (page_idx)->magic = 0;
+          if (run_length++ == 0)
+            run_start = page_idx;
+          continue;
+        }
+      if (run_length)
+        buddy_add_range (run_start, run_length);
+      run_length = 0;
+    }
+  if (run_length)
+    buddy_add_range (run_start, run_length);
 }
 
-void *
-allocate_page ()
+/* At most this many bootloader reclaimable ranges are handed back */
+#define PMM_RECLAIM_MAX 64
+
+void
+pmm_reclaim_bootloader ()
 {
-  for (size_t i = 0; i <= highest_page; ++i)
+  struct
+  {
+    uintptr_t base;
+    uintptr_t top;
+  } ranges[PMM_RECLAIM_MAX];
+  size_t range_count = 0;
+
+  /* The memory map itself is in reclaimable memory, so take a copy before
+   * the first page gets a free block header written into it */
+  size_t entry_count = memmap_request.response->entry_count;
+  struct limine_memmap_entry **entries = memmap_request.response->entries;
+  for (size_t i = 0; i < entry_count; i++)
     {
-      if (!BITMAP_GET (i))
+      struct limine_memmap_entry *entry = entries[i];
+      if (entry->type != LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE)
+        continue;
+      if (range_count == PMM_RECLAIM_MAX)
         {
-          BITMAP_SET (i);
-          used_pages++;
-          free_pages--;
+          printk ("pmm: too many reclaimable ranges, keeping the rest\n");
+          break;
+        }
+      ranges[range_count].base = ALIGN_UP (entry->base, PAGE_SIZE);
+      ranges[range_count].top
+          = (entry->base + entry->length) & ~(PAGE_SIZE - 1);
+      range_count++;
+    }
 
-          void *addr = (void *)((uintptr_t)i * PAGE_SIZE);
-          void *vaddr = (void *)((uintptr_t)addr + VMM_HIGHER_HALF);
+  /* We are still running on the stack Limine gave us. Nothing else may
+   * point into these ranges any more: the Limine responses still needed
+   * were copied out (hhdm_offset, the framebuffer in liminefb_init()) */
+  uintptr_t rsp;
+  asm volatile ("mov %%rsp, %0" : "=r"(rsp));
+  uintptr_t stack = rsp - VMM_HIGHER_HALF;
 
-          memset (vaddr, 0, PAGE_SIZE);
+  size_t reclaimed = 0;
+  uint64_t flags = cpu_irq_save ();
+  for (size_t i = 0; i < range_count; i++)
+    {
+      if (stack >= ranges[i].base && stack < ranges[i].top)
+        continue;
+
+      for (uintptr_t addr = ranges[i].base; addr < ranges[i].top;
+           addr += PAGE_SIZE)
+        {
+          size_t index = addr / PAGE_SIZE;
+          if (addr < 0x100000 || index > highest_page || !BITMAP_GET (index))
+            continue;
 
-          return addr;
+          pmm_bitmap_clear (index);
+          buddy_block (index)->magic = 0;
+          buddy_insert (index, 0);
+          total_ram_pages++;
+          free_page_count++;
+          reclaimed++;
         }
     }
+  cpu_irq_restore (flags);
+
+  printk ("pmm: reclaimed %llu KiB of bootloader memory\n",
+          (uint64_t)(reclaimed * PAGE_SIZE / 1024));
+}
+
+void *
+allocate_page_nozero ()
+{
+  uint64_t flags = cpu_irq_save ();
+
+  size_t word = pmm_find_free_word (next_fit_word);
+  if (word == (size_t)-1)
+    word = pmm_find_free_word (0);
+  if (word == (size_t)-1 && zero_pool_count > 0)
+    {
+      /* Zeroed for nothing, but better than failing */
+      void *addr = (void *)zero_pool[--zero_pool_count];
+      cpu_irq_restore (flags);
+      return addr;
+    }
+  if (word == (size_t)-1)
+    {
+      cpu_irq_restore (flags);
+      printk ("PMM Error: Out of physical memory!\n");
+      return NULL;
+    }
+
+  size_t i = word * 64 + __builtin_ctzll (~memory_bitmap[word]);
+  buddy_take_page (i);
+  pmm_bitmap_set (i);
+  page_refcounts[i] = 1;
+  next_fit_word = word;
+  used_pages++;
+  free_page_count--;
+
+  cpu_irq_restore (flags);
+  return (void *)((uintptr_t)i * PAGE_SIZE);
+}
+
+void *
+allocate_page ()
+{
+  uint64_t flags = cpu_irq_save ();
+  if (zero_pool_count > 0)
+    {
+      void *addr = (void *)zero_pool[--zero_pool_count];
+      cpu_irq_restore (flags);
+      return addr;
+    }
+  cpu_irq_restore (flags);
 
-  printk ("PMM Error: Out of physical memory!\n");
-  return NULL;
+  void *addr = allocate_page_nozero ();
+  if (addr == NULL)
+    return NULL;
+
+  void *vaddr = (void *)((uintptr_t)addr + VMM_HIGHER_HALF);
+  memset (vaddr, 0, PAGE_SIZE);
+
+  return addr;
+}
+
+/* Top up the pool of pre-zeroed pages. Called from the idle loop, so the
+ * zeroing itself runs with interrupts enabled. */
+void
+pmm_refill_zero_pool ()
+{
+  while (zero_pool_count < PMM_ZERO_POOL_SIZE)
+    {
+      if (free_page_count == 0)
+        return;
+
+      void *addr = allocate_page_nozero ();
+      if (addr == NULL)
+        return;
+      memset ((void *)((uintptr_t)addr + VMM_HIGHER_HALF), 0, PAGE_SIZE);
+
+      uint64_t flags = cpu_irq_save ();
+      if (zero_pool_count < PMM_ZERO_POOL_SIZE)
+        {
+          zero_pool[zero_pool_count++] = (uintptr_t)addr;
+          addr = NULL;
+        }
+      cpu_irq_restore (flags);
+
+      if (addr != NULL)
+        free_page (addr);
+    }
 }
 
 void
@@ -240,17 +679,120 @@ free_page (void *page)
       return;
     }
 
+  uint64_t flags = cpu_irq_save ();
   if (!BITMAP_GET (index))
     {
+      cpu_irq_restore (flags);
       printk (
           "Warning: PMM free_page called on already free page %p (index %u)\n",
           page, index);
       return;
     }
 
-  BITMAP_CLEAR (index);
+  pmm_bitmap_clear (index);
+  page_refcounts[index] = 0;
+  buddy_block (index)->magic = 0;
+  buddy_insert (index, 0);
   used_pages--;
-  free_pages++;
+  free_page_count++;
+  cpu_irq_restore (flags);
+}
+
+void *
+allocate_pages (size_t order)
+{
+  if (order > PMM_MAX_ORDER)
+    {
+      printk ("PMM Error: allocate_pages order %u too large\n",
+              (unsigned)order);
+      return NULL;
+    }
+
+  uint64_t flags = cpu_irq_save ();
+  size_t found = order;
+  while (found <= PMM_MAX_ORDER && buddy_free_lists[found] == NULL)
+    found++;
+  if (found > PMM_MAX_ORDER && zero_pool_count > 0)
+    {
+      /* The pooled pages may merge into a big enough block again */
+      pmm_drain_zero_pool ();
+      found = order;
+      while (found <= PMM_MAX_ORDER && buddy_free_lists[found] == NULL)
+        found++;
+    }
+  if (found > PMM_MAX_ORDER)
+    {
+      cpu_irq_restore (flags);
+      printk ("PMM Error: no free block of order %u\n", (unsigned)order);
+      return NULL;
+    }
+
+  size_t pfn = buddy_block_pfn (buddy_free_lists[found]);
+  buddy_unlink (pfn);
+  buddy_split (pfn, found, order);
+
+  size_t count = 1ul << order;
+  for (size_t i = 0; i < count; i++)
+    {
+      pmm_bitmap_set (pfn + i);
+      page_refcounts[pfn + i] = 1;
+    }
+  used_pages += count;
+  free_page_count -= count;
+  cpu_irq_restore (flags);
+
+  void *addr = (void *)((uintptr_t)pfn * PAGE_SIZE);
+  memset ((void *)((uintptr_t)addr + VMM_HIGHER_HALF), 0, count * PAGE_SIZE);
+
+  return addr;
+}
+
+void
+free_pages (void *base, size_t order)
+{
+  uintptr_t addr = (uintptr_t)base;
+  size_t count = 1ul << order;
+
+  if (base == NULL || order > PMM_MAX_ORDER
+      || addr % (count * PAGE_SIZE) != 0)
+    {
+      printk ("Warning: PMM free_pages called with bad block %p (order %u)\n",
+              base, (unsigned)order);
+      return;
+    }
+
+  size_t pfn = addr / PAGE_SIZE;
+  if (pfn + count - 1 > highest_page)
+    {
+      printk ("Warning: PMM free_pages called with block %p outside managed "
+              "range\n",
+              base);
+      return;
+    }
+
+  uint64_t flags = cpu_irq_save ();
+  for (size_t i = 0; i < count; i++)
+    {
+      if (!BITMAP_GET (pfn + i))
+        {
+          cpu_irq_restore (flags);
+          printk ("Warning: PMM free_pages called on block %p containing "
+                  "free page (index %u)\n",
+                  base, pfn + i);
+          return;
+        }
+    }
+
+  for (size_t i = 0; i < count; i++)
+    {
+      pmm_bitmap_clear (pfn + i);
+      page_refcounts[pfn + i] = 0;
+      buddy_block (pfn + i)->magic = 0;
+    }
+  buddy_insert (pfn, order);
+  used_pages -= count;
+  free_page_count += count;
+  cpu_irq_restore (flags);
 }
 
 bool
@@ -263,4 +805,54 @@ is_page_free (uintptr_t paddr)
     }
 
   return !BITMAP_GET (index);
-}
\ No newline at end of file
+}
+
+void
+page_ref (uintptr_t paddr)
+{
+  size_t index = paddr / PAGE_SIZE;
+  if (index > highest_page || !BITMAP_GET (index))
+    {
+      printk ("Warning: PMM page_ref called on unallocated page %p\n",
+              (void *)paddr);
+      return;
+    }
+
+  uint64_t flags = cpu_irq_save ();
+  if (page_refcounts[index] == UINT16_MAX)
+    {
+      panic ("pmm: page reference count overflow");
+    }
+  page_refcounts[index]++;
+  cpu_irq_restore (flags);
+}
+
+void
+page_unref (uintptr_t paddr)
+{
+  size_t index = paddr / PAGE_SIZE;
+  if (index > highest_page || !BITMAP_GET (index))
+    {
+      printk ("Warning: PMM page_unref called on unallocated page %p\n",
+              (void *)paddr);
+      return;
+    }
+
+  uint64_t flags = cpu_irq_save ();
+  bool last = page_refcounts[index] <= 1;
+  if (!last)
+    page_refcounts[index]--;
+  cpu_irq_restore (flags);
+
+  if (last)
+    free_page ((void *)(paddr & ~(uintptr_t)(PAGE_SIZE - 1)));
+}
+
+size_t
+page_refcount (uintptr_t paddr)
+{
+  size_t index = paddr / PAGE_SIZE;
+  if (index > highest_page)
+    return 0;
+  return page_refcounts[index];
+}
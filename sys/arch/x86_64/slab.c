@@ -0,0 +1,362 @@
+/*-
+ * SPDX-License-Identifier: 0BSD
+ *
+ * Copyright (c) 2025 V. Prokopenko
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <x86_64/cpu.h>
+#include <x86_64/page.h>
+#include <x86_64/slab.h>
+#include <x86_64/vmm/vmm_map.h>
+#include <sys/mount.h>
+#include <sys/panic.h>
+#include <sys/printk.h>
+#include <sys/string.h>
+
+/* Object caches (kmem_cache) and the kmalloc() size classes built on them.
+ *
+ * Every cache carves its objects out of 16 KiB slabs taken from the buddy
+ * allocator and accessed through the HHDM. A slab starts with a kmem_slab_t
+ * header followed by the objects; free objects are chained through a link
+ * word. Because buddy blocks are naturally aligned, the header of any
+ * object is found by masking its address, which keeps both allocation and
+ * free O(1).
+ *
+ * Slabs live on the partial, full or empty list of their cache. Allocation
+ * prefers partial slabs, then empty ones; one empty slab per cache is kept
+ * around and further empty ones go back to the PMM. Unused space at the end
+ * of a slab is used to start the objects of successive slabs at different
+ * offsets (coloring), so equally indexed objects of different slabs don't
+ * all compete for the same cache sets.
+ *
+ * Sizes up to SLAB_MAX_SIZE go to one of the kmalloc caches below (powers
+ * of two and 1.5x steps in between). */
+
+#define SLAB_ORDER 2
+#define SLAB_BYTES (PAGE_SIZE << SLAB_ORDER)
+#define SLAB_MAGIC 0x51AB51AB
+#define SLAB_ALIGN 16
+#define KMEM_CACHE_MAX_EMPTY 1
+
+typedef struct kmem_slab
+{
+  uint32_t magic;
+  uint16_t inuse;
+  kmem_cache_t *cache;
+  uintptr_t base; /* first object, after the color offset */
+  void *free;
+  struct kmem_slab *prev;
+  struct kmem_slab *next;
+} kmem_slab_t;
+
+#define SLAB_HEADER_SIZE ALIGN_UP (sizeof (kmem_slab_t), SLAB_ALIGN)
+
+/* Caches are allocated from this one */
+static kmem_cache_t kmem_cache_cache;
+static kmem_cache_t *kmem_caches;
+
+/* No 24 byte class, so that every object stays 16 byte aligned */
+static const size_t kmalloc_sizes[] = {
+  16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048,
+};
+
+#define KMALLOC_CACHE_COUNT (sizeof (kmalloc_sizes) / sizeof (kmalloc_sizes[0]))
+
+static kmem_cache_t *kmalloc_caches[KMALLOC_CACHE_COUNT];
+
+/* Size (in SLAB_ALIGN units, rounded up) to kmalloc cache index */
+static uint8_t kmalloc_lookup[SLAB_MAX_SIZE / SLAB_ALIGN + 1];
+
+static bool
+kmem_cache_setup (kmem_cache_t *cache, const char *name, size_t size,
+                  size_t align, void (*ctor) (void *))
+{
+  if (align == 0)
+    align = SLAB_ALIGN;
+  if ((align & (align - 1)) != 0 || align > PAGE_SIZE || size == 0)
+    return false;
+
+  memset (cache, 0, sizeof (kmem_cache_t));
+
+  size_t i = 0;
+  for (; name[i] && i < KMEM_CACHE_NAME_LENGTH - 1; i++)
+    cache->name[i] = name[i];
+  cache->name[i] = '\0';
+
+  /* A constructed object must survive being free, so its link goes after
+   * it instead of over its first word */
+  cache->object_size = size;
+  cache->link_offset = ctor ? ALIGN_UP (size, sizeof (void *)) : 0;
+  cache->size = ALIGN_UP (ctor ? cache->link_offset + sizeof (void *) : size,
+                          align);
+  if (cache->size < sizeof (void *))
+    cache->size = ALIGN_UP (sizeof (void *), align);
+  cache->align = align;
+  cache->ctor = ctor;
+
+  size_t first = ALIGN_UP (SLAB_HEADER_SIZE, align);
+  if (first + cache->size > SLAB_BYTES)
+    return false;
+  cache->objects = (SLAB_BYTES - first) / cache->size;
+  cache->colors = (SLAB_BYTES - first - cache->objects * cache->size) / align
+                  + 1;
+
+  cache->next = kmem_caches;
+  kmem_caches = cache;
+  return true;
+}
+
+kmem_cache_t *
+kmem_cache_create (const char *name, size_t size, size_t align,
+                   void (*ctor) (void *))
+{
+  kmem_cache_t *cache = kmem_cache_alloc (&kmem_cache_cache);
+  if (!cache)
+    return NULL;
+
+  if (!kmem_cache_setup (cache, name, size, align, ctor))
+    {
+      printk ("slab: kmem_cache_create: bad geometry for %s\n", name);
+      kmem_cache_free (&kmem_cache_cache, cache);
+      return NULL;
+    }
+  return cache;
+}
+
+void
+slab_init (void)
+{
+  if (!kmem_cache_setup (&kmem_cache_cache, "kmem_cache",
+                         sizeof (kmem_cache_t), 0, NULL))
+    {
+      panic ("slab: failed to set up the cache cache");
+    }
+
+  for (size_t i = 0; i < KMALLOC_CACHE_COUNT; i++)
+    {
+      char name[KMEM_CACHE_NAME_LENGTH];
+      snprintf (name, sizeof (name), "kmalloc-%u",
+                (unsigned)kmalloc_sizes[i]);
+      kmalloc_caches[i] = kmem_cache_create (name, kmalloc_sizes[i], 0, NULL);
+      if (!kmalloc_caches[i])
+        panic ("slab: failed to create the kmalloc caches");
+    }
+
+  size_t index = 0;
+  for (size_t units = 0; units <= SLAB_MAX_SIZE / SLAB_ALIGN; units++)
+    {
+      while (kmalloc_sizes[index] < units * SLAB_ALIGN)
+        index++;
+      kmalloc_lookup[units] = index;
+    }
+}
+
+/* The list a slab belongs on, going by how many objects are in use */
+static kmem_slab_t **
+kmem_slab_list (kmem_slab_t *slab)
+{
+  kmem_cache_t *cache = slab->cache;
+  if (slab->inuse == 0)
+    return &cache->empty;
+  if (slab->inuse == cache->objects)
+    return &cache->full;
+  return &cache->partial;
+}
+
+static void
+kmem_slab_unlink (kmem_slab_t *slab)
+{
+  kmem_slab_t **list = kmem_slab_list (slab);
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    *list = slab->next;
+  if (slab->next)
+    slab->next->prev = slab->prev;
+  slab->prev = slab->next = NULL;
+}
+
+static void
+kmem_slab_link (kmem_slab_t *slab)
+{
+  kmem_slab_t **list = kmem_slab_list (slab);
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list)
+    (*list)->prev = slab;
+  *list = slab;
+}
+
+static kmem_slab_t *
+kmem_slab_create (kmem_cache_t *cache)
+{
+  void *phys = allocate_pages (SLAB_ORDER);
+  if (!phys)
+    return NULL;
+
+  kmem_slab_t *slab = (kmem_slab_t *)((uintptr_t)phys + VMM_HIGHER_HALF);
+  slab->magic = SLAB_MAGIC;
+  slab->inuse = 0;
+  slab->cache = cache;
+  slab->base = (uintptr_t)slab + ALIGN_UP (SLAB_HEADER_SIZE, cache->align)
+               + cache->color_next * cache->align;
+  cache->color_next = (cache->color_next + 1) % cache->colors;
+
+  /* Chain the objects in address order */
+  slab->free = NULL;
+  for (size_t i = cache->objects; i-- > 0;)
+    {
+      uintptr_t obj = slab->base + i * cache->size;
+      if (cache->ctor)
+        cache->ctor ((void *)obj);
+      *(void **)(obj + cache->link_offset) = slab->free;
+      slab->free = (void *)obj;
+    }
+
+  kmem_slab_link (slab);
+  cache->slab_count++;
+  cache->empty_count++;
+  return slab;
+}
+
+static void
+kmem_slab_destroy (kmem_slab_t *slab)
+{
+  kmem_cache_t *cache = slab->cache;
+  kmem_slab_unlink (slab);
+  cache->slab_count--;
+  cache->empty_count--;
+  slab->magic = 0;
+  free_pages ((void *)((uintptr_t)slab - VMM_HIGHER_HALF), SLAB_ORDER);
+}
+
+static kmem_slab_t *
+kmem_slab_of (void *ptr)
+{
+  kmem_slab_t *slab
+      = (kmem_slab_t *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_BYTES - 1));
+  if (slab->magic != SLAB_MAGIC || (uintptr_t)ptr < slab->base
+      || ((uintptr_t)ptr - slab->base) % slab->cache->size != 0)
+    {
+      panic ("slab: invalid pointer or slab corruption detected");
+    }
+  return slab;
+}
+
+void *
+kmem_cache_alloc (kmem_cache_t *cache)
+{
+  uint64_t flags = cpu_irq_save ();
+
+  kmem_slab_t *slab = cache->partial;
+  if (!slab)
+    slab = cache->empty;
+  if (!slab)
+    slab = kmem_slab_create (cache);
+  if (!slab)
+    {
+      cpu_irq_restore (flags);
+      return NULL;
+    }
+
+  kmem_slab_unlink (slab);
+  if (slab->inuse == 0)
+    cache->empty_count--;
+
+  void *obj = slab->free;
+  slab->free = *(void **)((uintptr_t)obj + cache->link_offset);
+  slab->inuse++;
+  cache->active_objects++;
+
+  kmem_slab_link (slab);
+
+  cpu_irq_restore (flags);
+  return obj;
+}
+
+void
+kmem_cache_free (kmem_cache_t *cache, void *obj)
+{
+  kmem_slab_t *slab = kmem_slab_of (obj);
+  if (slab->cache != cache)
+    panic ("slab: kmem_cache_free: object freed to the wrong cache");
+
+  uint64_t flags = cpu_irq_save ();
+
+  kmem_slab_unlink (slab);
+
+  *(void **)((uintptr_t)obj + cache->link_offset) = slab->free;
+  slab->free = obj;
+  slab->inuse--;
+  cache->active_objects--;
+
+  kmem_slab_link (slab);
+  if (slab->inuse == 0)
+    {
+      cache->empty_count++;
+      if (cache->empty_count > KMEM_CACHE_MAX_EMPTY)
+        kmem_slab_destroy (slab);
+    }
+
+  cpu_irq_restore (flags);
+}
+
+void *
+slab_alloc (size_t size)
+{
+  if (size == 0 || size > SLAB_MAX_SIZE)
+    return NULL;
+
+  return kmem_cache_alloc (
+      kmalloc_caches[kmalloc_lookup[(size + SLAB_ALIGN - 1) / SLAB_ALIGN]]);
+}
+
+void
+slab_free (void *ptr)
+{
+  kmem_cache_free (kmem_slab_of (ptr)->cache, ptr);
+}
+
+size_t
+slab_size (void *ptr)
+{
+  return kmem_slab_of (ptr)->cache->object_size;
+}
+
+/* /dev/slabinfo: "name active-objects slabs object-size" per cache */
+int
+slabinfo_read (char *data, void *buffer, int size)
+{
+  (void)data; /* unused */
+  char *buf = buffer;
+  int len = 0;
+
+  for (kmem_cache_t *cache = kmem_caches; cache && len < size;
+       cache = cache->next)
+    {
+      len += snprintf (buf + len, size - len, "%s %llu %llu %llu\n",
+                       cache->name, (uint64_t)cache->active_objects,
+                       (uint64_t)cache->slab_count,
+                       (uint64_t)cache->object_size);
+    }
+
+  return len;
+}
+
+fs_operations_t slabinfo_ops = {
+  .read = slabinfo_read,
+};
@@ -27,7 +27,13 @@
 #include <liminefb.h>
 #include <stdint.h>
 #include <sys/portb.h>
+#include <sys/ktrace.h>
 #include <sys/printk.h>
+#include <sys/proc.h>
+#include <x86_64/fpu.h>
+#include <x86_64/vmm/vmm_clone.h>
+#include <x86_64/vmm/vmm_map.h>
+#include <x86_64/vmm/vmm_region.h>
 
 typedef struct
 {
@@ -38,6 +44,7 @@ typedef struct
 } registers_t;
 
 extern void atkbd_irq ();
+extern void uart_irq ();
 extern void schedule ();
 int ticks = 0;
 
@@ -66,7 +73,8 @@ const char *trap_msgs[] = {
 void
 infinite_loop ()
 {
-  printk ("system halted\n");
+  printk_panic ();
+  printk (KERN_EMERG "system halted\n");
   for (;;)
     {
       asm volatile ("cli");
@@ -74,9 +82,66 @@ infinite_loop ()
     }
 }
 
+/* Page fault error code bits */
+#define PF_PRESENT (1 << 0) /* protection violation, not a missing page */
+#define PF_WRITE (1 << 1)
+#define PF_USER (1 << 2)
+#define PF_RSVD (1 << 3)
+#define PF_INSTR (1 << 4)
+
+/* Try to resolve a page fault. Returns false if it is a real error. */
+bool
+page_fault_handler (registers_t *regs)
+{
+  uintptr_t addr;
+  asm volatile ("mov %%cr2, %0" : "=r"(addr));
+  ktrace ("pf: addr %llx rip %llx err %llx", addr, regs->rip, regs->err_code);
+
+  if (current_pagemap == NULL)
+    return false;
+
+  bool write = regs->err_code & PF_WRITE;
+  bool user = regs->err_code & PF_USER;
+
+  if (regs->err_code & PF_RSVD)
+    {
+      /* Corrupted page tables, nothing to fix up */
+    }
+  else if (!(regs->err_code & PF_PRESENT))
+    {
+      if (vmm_handle_demand_fault (current_pagemap, addr, write, user))
+        {
+          proc_count_fault (PROC_FAULT_DEMAND);
+          return true;
+        }
+    }
+  else if (write)
+    {
+      if (vmm_handle_cow_fault (current_pagemap, addr))
+        {
+          proc_count_fault (PROC_FAULT_COW);
+          return true;
+        }
+    }
+
+  proc_count_fault (PROC_FAULT_BAD);
+
+  printk ("page fault at %llx (rip %llx)\n", addr, regs->rip);
+  return false;
+}
+
 void
 isr_handler_c (registers_t *regs)
 {
+  if (regs->int_no == 14 && page_fault_handler (regs))
+    {
+      return;
+    }
+  if (regs->int_no == 7 && fpu_handle_nm ())
+    {
+      return;
+    }
+
   if (regs->int_no < 19)
     {
       printk ("unhandled exception: %s (err code %llx)\n",
@@ -98,6 +163,7 @@ irq_handler_c (registers_t *regs)
     }
   outb (0x20, 0x20);
 
+  ktrace ("irq: %llu", regs->int_no);
   switch (regs->int_no)
     {
     case 32:
@@ -107,6 +173,9 @@ irq_handler_c (registers_t *regs)
     case 33:
       atkbd_irq ();
       break;
+    case 36:
+      uart_irq ();
+      break;
     default:
       printk ("Unhandled IRQ: %llu\n", regs->int_no);
       break;
@@ -177,6 +246,7 @@ extern void do_isr18 ();
 
 extern void do_irq0 ();
 extern void do_irq1 ();
+extern void do_irq4 ();
 
 void
 trap_init ()
@@ -214,6 +284,7 @@ trap_init ()
 
   add_irq ("apit", 32, (uint64_t)do_irq0, 0x08, 0x8E);
   add_irq ("kbd", 33, (uint64_t)do_irq1, 0x08, 0x8E);
+  add_irq ("com1", 36, (uint64_t)do_irq4, 0x08, 0x8E);
 
   idtptr.limit = (sizeof (struct idt_entry) * 256) - 1;
   idtptr.base = (uint64_t)&idt;
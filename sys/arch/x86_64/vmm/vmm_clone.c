@@ -19,7 +19,9 @@
 #include <stdint.h>
 
 #include <x86_64/page.h>
+#include <x86_64/vmm/vmm_clone.h>
 #include <x86_64/vmm/vmm_map.h>
+#include <x86_64/vmm/vmm_region.h>
 #include <sys/panic.h>
 #include <sys/printk.h>
 #include <sys/string.h>
@@ -29,6 +31,11 @@
  *
  * Don't look into the code below. Even worse, don't even try to understand it.
  * It is pure insanity
+ *
+ * Data pages are either copied up front or, with VMM_CLONE_COW, shared
+ * read-only between both pagemaps and copied on the first write (see
+ * vmm_handle_cow_fault). Shared pages are reference counted by the PMM, so
+ * freeing a clone only drops a reference.
  */
 
 /* Free a cloned pagemap */
@@ -42,6 +49,8 @@ vmm_free_pagemap_clone (pagemap_t *clone)
     }
   uint64_t *pml4 = clone->top_level;
 
+  vmm_free_regions (clone);
+
   for (int pml4_i = 0; pml4_i < 512; ++pml4_i)
     {
       uint64_t pml4_e = pml4[pml4_i];
@@ -83,7 +92,7 @@ vmm_free_pagemap_clone (pagemap_t *clone)
                     continue;
 
                   uintptr_t phys = PTE_GET_ADDR (pte);
-                  free_page ((void *)phys);
+                  page_unref (phys);
                   pt[pt_i] = 0;
                 }
 
@@ -108,8 +117,10 @@ vmm_free_pagemap_clone (pagemap_t *clone)
 
 /* Clone a pagemap. Like I said before, it only works for userspace pagemaps */
 pagemap_t *
-vmm_clone_pagemap (pagemap_t *src)
+vmm_clone_pagemap (pagemap_t *src, int clone_flags)
 {
+  bool cow = clone_flags & VMM_CLONE_COW;
+
   if (!src || !src->top_level)
     {
       printk ("vmm: vmm_clone_pagemap: invalid src\n");
@@ -124,7 +135,6 @@ vmm_clone_pagemap (pagemap_t *src)
     }
   pagemap_t *child_map
       = (pagemap_t *)((uintptr_t)child_map_page_phys + VMM_HIGHER_HALF);
-  memset (child_map, 0, PAGE_SIZE);
 
   void *child_pml4_phys = allocate_page ();
   if (!child_pml4_phys)
@@ -135,11 +145,17 @@ vmm_clone_pagemap (pagemap_t *src)
     }
   uint64_t *child_pml4
       = (uint64_t *)((uintptr_t)child_pml4_phys + VMM_HIGHER_HALF);
-  memset (child_pml4, 0, PAGE_SIZE);
 
   child_map->top_level = child_pml4;
+  child_map->regions = NULL;
+  child_map->pcid_generation = 0;
 
   uint64_t *src_pml4 = src->top_level;
+  bool src_changed = false;
+
+  /* Untouched parts of the regions stay demand paged in the child */
+  if (!vmm_copy_regions (child_map, src))
+    goto clone_fail;
 
   for (int pml4_i = 0; pml4_i < 512; ++pml4_i)
     {
@@ -164,7 +180,6 @@ vmm_clone_pagemap (pagemap_t *src)
         goto clone_fail;
       uint64_t *child_pdpt
           = (uint64_t *)((uintptr_t)child_pdpt_phys + VMM_HIGHER_HALF);
-      memset (child_pdpt, 0, PAGE_SIZE);
       child_pml4[pml4_i]
           = (uint64_t)(uintptr_t)child_pdpt_phys | (src_pml4_e & 0xFFF);
 
@@ -183,7 +198,6 @@ vmm_clone_pagemap (pagemap_t *src)
             goto clone_fail;
           uint64_t *child_pd
               = (uint64_t *)((uintptr_t)child_pd_phys + VMM_HIGHER_HALF);
-          memset (child_pd, 0, PAGE_SIZE);
           child_pdpt[pdpt_i]
               = (uint64_t)(uintptr_t)child_pd_phys | (src_pdpt_e & 0xFFF);
 
@@ -202,7 +216,6 @@ vmm_clone_pagemap (pagemap_t *src)
                 goto clone_fail;
               uint64_t *child_pt
                   = (uint64_t *)((uintptr_t)child_pt_phys + VMM_HIGHER_HALF);
-              memset (child_pt, 0, PAGE_SIZE);
               child_pd[pd_i]
                   = (uint64_t)(uintptr_t)child_pt_phys | (src_pd_e & 0xFFF);
 
@@ -214,7 +227,21 @@ vmm_clone_pagemap (pagemap_t *src)
 
                   uintptr_t src_phys = PTE_GET_ADDR (src_pte);
 
-                  void *child_page_phys = allocate_page ();
+                  if (cow)
+                    {
+                      if (src_pte & PTE_WRITABLE)
+                        {
+                          src_pte = (src_pte & ~PTE_WRITABLE) | PTE_COW;
+                          src_pt[pt_i] = src_pte;
+                          src_changed = true;
+                        }
+                      page_ref (src_phys);
+                      child_pt[pt_i] = src_pte;
+                      continue;
+                    }
+
+                  /* The whole page is overwritten below, don't zero it */
+                  void *child_page_phys = allocate_page_nozero ();
                   if (!child_page_phys)
                     goto clone_fail;
 
@@ -231,12 +258,51 @@ vmm_clone_pagemap (pagemap_t *src)
         }
     }
 
+  if (src_changed)
+    vmm_flush_pagemap (src);
+
   return child_map;
 
 clone_fail:
   printk ("vmm: vmm_clone_pagemap: clone_fail\n");
+  if (src_changed)
+    vmm_flush_pagemap (src);
   vmm_free_pagemap_clone (child_map);
 
   free_page (child_map_page_phys);
   return NULL;
+}
+
+/* Resolve a write fault on a copy-on-write page. The last user of a shared
+ * page gets it back writable, everyone else gets a private copy. Returns
+ * false if virt_addr is not a copy-on-write mapping. */
+bool
+vmm_handle_cow_fault (pagemap_t *pagemap, uintptr_t virt_addr)
+{
+  virt_addr &= ~(uintptr_t)(PAGE_SIZE - 1);
+
+  uint64_t *pte = vmm_get_pte (pagemap, virt_addr, false);
+  if (!pte || (*pte & (PTE_PRESENT | PTE_COW)) != (PTE_PRESENT | PTE_COW))
+    return false;
+
+  uintptr_t phys = PTE_GET_ADDR (*pte);
+  uint64_t flags = (PTE_GET_FLAGS (*pte) & ~PTE_COW) | PTE_WRITABLE;
+
+  if (page_refcount (phys) > 1)
+    {
+      void *copy_phys = allocate_page_nozero ();
+      if (!copy_phys)
+        {
+          printk ("vmm: vmm_handle_cow_fault: out of memory\n");
+          return false;
+        }
+      memcpy ((void *)((uintptr_t)copy_phys + VMM_HIGHER_HALF),
+              (void *)(phys + VMM_HIGHER_HALF), PAGE_SIZE);
+      page_unref (phys);
+      phys = (uintptr_t)copy_phys;
+    }
+
+  *pte = phys | flags;
+  vmm_invalidate_page (pagemap, virt_addr);
+  return true;
 }
\ No newline at end of file
@@ -7,14 +7,24 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <x86_64/cpu.h>
 #include <x86_64/page.h>
 #include <x86_64/request.h>
 #include <x86_64/vmm/vmm_map.h>
+#include <x86_64/vmm/vmm_range.h>
 #include <sys/panic.h>
 #include <sys/printk.h>
 #include <sys/string.h>
 
 pagemap_t *kernel_pagemap = NULL;
+pagemap_t *current_pagemap = NULL;
+
+#define PCID_COUNT 4096
+/* Keep the TLB entries tagged with the new PCID when loading CR3 */
+#define CR3_NOFLUSH (1ull << 63)
+
+static uint16_t next_pcid = 1;
+static uint64_t pcid_generation = 1;
 
 static bool
 vmm_is_table_empty (uint64_t *table_virt)
@@ -29,12 +39,26 @@ vmm_is_table_empty (uint64_t *table_virt)
   return true;
 }
 
+uint64_t
+vmm_leaf_flags (uintptr_t virt_addr, uint64_t flags)
+{
+  if (cpu_features.pge && virt_addr >= (uintptr_t)VMM_HIGHER_HALF)
+    flags |= PTE_GLOBAL;
+  return flags;
+}
+
 uint64_t *
 vmm_get_next_level (uint64_t *current_level_virt, size_t index, bool allocate,
                     uint64_t alloc_entry_flags)
 {
   uint64_t entry = current_level_virt[index];
 
+  /* A large page, there is no next level to walk into */
+  if ((entry & (PTE_PRESENT | PTE_PS)) == (PTE_PRESENT | PTE_PS))
+    {
+      return NULL;
+    }
+
   if (entry & PTE_PRESENT)
     {
       return (uint64_t *)(PTE_GET_ADDR (entry) + VMM_HIGHER_HALF);
@@ -56,7 +80,6 @@ vmm_get_next_level (uint64_t *current_level_virt, size_t index, bool allocate,
 
   uint64_t *next_level_virt
       = (uint64_t *)((uintptr_t)next_level_phys + VMM_HIGHER_HALF);
-  memset (next_level_virt, 0, PAGE_SIZE);
 
   uint64_t new_entry_flags
       = alloc_entry_flags ? alloc_entry_flags : (PTE_PRESENT | PTE_WRITABLE);
@@ -94,9 +117,11 @@ vmm_map_page (pagemap_t *pagemap, uintptr_t virt_addr, uintptr_t phys_addr,
   if (!pt)
     goto fail;
 
-  pt[pt_index] = phys_addr | flags | PTE_PRESENT;
+  bool was_present = pt[pt_index] & PTE_PRESENT;
+  pt[pt_index] = phys_addr | vmm_leaf_flags (virt_addr, flags) | PTE_PRESENT;
 
-  asm volatile ("invlpg (%0)" ::"r"(virt_addr) : "memory");
+  if (was_present)
+    vmm_invalidate_page (pagemap, virt_addr);
   return true;
 
 fail:
@@ -105,6 +130,104 @@ fail:
   return false;
 }
 
+bool
+vmm_map_large_page (pagemap_t *pagemap, uintptr_t virt_addr,
+                    uintptr_t phys_addr, uint64_t flags, size_t size)
+{
+  if ((size != PAGE_SIZE_2M && size != PAGE_SIZE_1G)
+      || (size == PAGE_SIZE_1G && !cpu_features.gbpages)
+      || virt_addr % size != 0 || phys_addr % size != 0)
+    {
+      printk ("vmm: vmm_map_large_page: bad large page for virt %llx\n",
+              (void *)virt_addr);
+      return false;
+    }
+
+  size_t pml4_index = (virt_addr >> 39) & 0x1FF;
+  size_t pdpt_index = (virt_addr >> 30) & 0x1FF;
+  size_t pd_index = (virt_addr >> 21) & 0x1FF;
+
+  uint64_t alloc_flags = PTE_PRESENT | PTE_WRITABLE;
+  if (flags & PTE_USER)
+    alloc_flags |= PTE_USER;
+
+  uint64_t *pml4 = pagemap->top_level;
+  uint64_t *pdpt = vmm_get_next_level (pml4, pml4_index, true, alloc_flags);
+  if (!pdpt)
+    goto fail;
+
+  uint64_t *table = pdpt;
+  size_t index = pdpt_index;
+  if (size == PAGE_SIZE_2M)
+    {
+      table = vmm_get_next_level (pdpt, pdpt_index, true, alloc_flags);
+      if (!table)
+        goto fail;
+      index = pd_index;
+    }
+
+  /* Don't silently leak a page table that is already hanging off here */
+  if ((table[index] & PTE_PRESENT) && !(table[index] & PTE_PS))
+    goto fail;
+
+  bool was_present = table[index] & PTE_PRESENT;
+  table[index]
+      = phys_addr | vmm_leaf_flags (virt_addr, flags) | PTE_PS | PTE_PRESENT;
+
+  if (was_present)
+    vmm_invalidate_page (pagemap, virt_addr);
+  return true;
+
+fail:
+  printk ("vmm: vmm_map_large_page: failed to map page for virt %llx\n",
+          (void *)virt_addr);
+  return false;
+}
+
+/* Map a physically contiguous range with the largest pages that fit.
+ * Everything is expected to be PAGE_SIZE aligned. */
+static bool
+vmm_map_contiguous (pagemap_t *pagemap, uintptr_t virt_addr,
+                    uintptr_t phys_addr, size_t length, uint64_t flags)
+{
+  while (length > 0)
+    {
+      size_t step = PAGE_SIZE;
+      if (cpu_features.gbpages && length >= PAGE_SIZE_1G
+          && virt_addr % PAGE_SIZE_1G == 0 && phys_addr % PAGE_SIZE_1G == 0)
+        {
+          step = PAGE_SIZE_1G;
+        }
+      else if (length >= PAGE_SIZE_2M && virt_addr % PAGE_SIZE_2M == 0
+               && phys_addr % PAGE_SIZE_2M == 0)
+        {
+          step = PAGE_SIZE_2M;
+        }
+
+      bool ok;
+      if (step == PAGE_SIZE)
+        {
+          /* Map 4 KiB pages up to the next 2 MiB boundary in one go */
+          step = ALIGN_UP (virt_addr + 1, PAGE_SIZE_2M) - virt_addr;
+          if (step > length)
+            step = length;
+          ok = vmm_map_range (pagemap, virt_addr, phys_addr, step, flags);
+        }
+      else
+        {
+          ok = vmm_map_large_page (pagemap, virt_addr, phys_addr, flags,
+                                   step);
+        }
+      if (!ok)
+        return false;
+
+      virt_addr += step;
+      phys_addr += step;
+      length -= step;
+    }
+  return true;
+}
+
 bool
 vmm_unmap_page (pagemap_t *pagemap, uintptr_t virt_addr)
 {
@@ -128,6 +251,8 @@ vmm_unmap_page (pagemap_t *pagemap, uintptr_t virt_addr)
     }
   uint64_t pdpt_entry = pml4[pml4_index];
 
+  if (pdpt[pdpt_index] & PTE_PS)
+    goto large;
   uint64_t *pd = vmm_get_next_level (pdpt, pdpt_index, false, 0);
   if (!pd)
     {
@@ -135,6 +260,8 @@ vmm_unmap_page (pagemap_t *pagemap, uintptr_t virt_addr)
     }
   uint64_t pd_entry = pdpt[pdpt_index];
 
+  if (pd[pd_index] & PTE_PS)
+    goto large;
   uint64_t *pt = vmm_get_next_level (pd, pd_index, false, 0);
   if (!pt)
     {
@@ -149,7 +276,7 @@ vmm_unmap_page (pagemap_t *pagemap, uintptr_t virt_addr)
 
   pt[pt_index] = 0;
 
-  asm volatile ("invlpg (%0)" ::"r"(virt_addr) : "memory");
+  vmm_invalidate_page (pagemap, virt_addr);
 
   if (vmm_is_table_empty (pt))
     {
@@ -175,6 +302,38 @@ vmm_unmap_page (pagemap_t *pagemap, uintptr_t virt_addr)
     }
 
   return true;
+
+large:
+  printk ("vmm: vmm_unmap_page: virt %llx is part of a large page\n",
+          (void *)virt_addr);
+  return false;
+}
+
+uint64_t *
+vmm_get_pte (pagemap_t *pagemap, uintptr_t virt_addr, bool allocate)
+{
+  size_t pml4_index = (virt_addr >> 39) & 0x1FF;
+  size_t pdpt_index = (virt_addr >> 30) & 0x1FF;
+  size_t pd_index = (virt_addr >> 21) & 0x1FF;
+  size_t pt_index = (virt_addr >> 12) & 0x1FF;
+
+  uint64_t alloc_flags = PTE_PRESENT | PTE_WRITABLE;
+  if (virt_addr < (uintptr_t)VMM_HIGHER_HALF)
+    alloc_flags |= PTE_USER;
+
+  uint64_t *pml4 = pagemap->top_level;
+  uint64_t *pdpt
+      = vmm_get_next_level (pml4, pml4_index, allocate, alloc_flags);
+  if (pdpt == NULL)
+    return NULL;
+  uint64_t *pd = vmm_get_next_level (pdpt, pdpt_index, allocate, alloc_flags);
+  if (pd == NULL)
+    return NULL;
+  uint64_t *pt = vmm_get_next_level (pd, pd_index, allocate, alloc_flags);
+  if (pt == NULL)
+    return NULL;
+
+  return &pt[pt_index];
 }
 
 uintptr_t
@@ -192,12 +351,24 @@ vmm_virt_to_phys (pagemap_t *pagemap, uintptr_t virt_addr)
       return (uintptr_t)-1;
     }
 
+  if ((pdpt[pdpt_index] & (PTE_PRESENT | PTE_PS)) == (PTE_PRESENT | PTE_PS))
+    {
+      return (pdpt[pdpt_index] & PTE_ADDR_MASK & ~(PAGE_SIZE_1G - 1))
+             + virt_addr % PAGE_SIZE_1G;
+    }
+
   uint64_t *pd = vmm_get_next_level (pdpt, pdpt_index, false, 0);
   if (pd == NULL)
     {
       return (uintptr_t)-1;
     }
 
+  if ((pd[pd_index] & (PTE_PRESENT | PTE_PS)) == (PTE_PRESENT | PTE_PS))
+    {
+      return (pd[pd_index] & PTE_ADDR_MASK & ~(PAGE_SIZE_2M - 1))
+             + virt_addr % PAGE_SIZE_2M;
+    }
+
   uint64_t *pt = vmm_get_next_level (pd, pd_index, false, 0);
   if (pt == NULL)
     {
@@ -217,6 +388,29 @@ vmm_virt_to_phys (pagemap_t *pagemap, uintptr_t virt_addr)
   return phys_addr_base + offset;
 }
 
+/* Hand out a fresh PCID. 0 is kept for the kernel pagemap; the others are
+ * given out in order and, once they run out, all recycled at once by starting
+ * a new generation. A PCID from an older generation is never trusted, so
+ * whoever gets a recycled one flushes it on the first load. */
+static void
+vmm_assign_pcid (pagemap_t *pagemap)
+{
+  if (pagemap != kernel_pagemap)
+    {
+      if (next_pcid == PCID_COUNT)
+        {
+          pcid_generation++;
+          next_pcid = 1;
+        }
+      pagemap->pcid = next_pcid++;
+    }
+  else
+    {
+      pagemap->pcid = 0;
+    }
+  pagemap->pcid_generation = pcid_generation;
+}
+
 void
 vmm_switch_to (pagemap_t *pagemap)
 {
@@ -226,9 +420,84 @@ vmm_switch_to (pagemap_t *pagemap)
       return;
     }
 
-  uintptr_t pml4_phys = (uintptr_t)pagemap->top_level - VMM_HIGHER_HALF;
+  uintptr_t cr3 = (uintptr_t)pagemap->top_level - VMM_HIGHER_HALF;
 
-  asm volatile ("mov %0, %%cr3" ::"r"(pml4_phys) : "memory");
+  if (cpu_features.pcid)
+    {
+      if (pagemap->pcid_generation == pcid_generation)
+        {
+          /* Whatever is tagged with this PCID is still valid */
+          cr3 |= CR3_NOFLUSH;
+        }
+      else
+        {
+          vmm_assign_pcid (pagemap);
+        }
+      cr3 |= pagemap->pcid;
+    }
+
+  asm volatile ("mov %0, %%cr3" ::"r"(cr3) : "memory");
+  current_pagemap = pagemap;
+}
+
+void
+vmm_flush_pagemap (pagemap_t *pagemap)
+{
+  if (pagemap != current_pagemap)
+    {
+      /* Without PCIDs inactive pagemaps have nothing cached. With them,
+       * drop the PCID so the next vmm_switch_to() starts clean. */
+      pagemap->pcid_generation = 0;
+      return;
+    }
+
+  /* A CR3 load without the no-flush bit flushes the current PCID */
+  uintptr_t cr3;
+  asm volatile ("mov %%cr3, %0" : "=r"(cr3));
+  asm volatile ("mov %0, %%cr3" ::"r"(cr3) : "memory");
+}
+
+void
+vmm_flush_all (void)
+{
+  if (cpu_features.pge)
+    {
+      cpu_flush_global_tlb ();
+      return;
+    }
+
+  /* The kernel half is shared, so other address spaces may have it cached
+   * under their own PCID. Starting a new generation retires all of them. */
+  pcid_generation++;
+  next_pcid = 1;
+
+  if (current_pagemap)
+    vmm_flush_pagemap (current_pagemap);
+}
+
+void
+vmm_invalidate_page (pagemap_t *pagemap, uintptr_t virt_addr)
+{
+  if (virt_addr >= (uintptr_t)VMM_HIGHER_HALF)
+    {
+      /* Shared by every pagemap. Kernel mappings are global, and invlpg
+       * drops global entries whatever PCID is current; without PGE they may
+       * be cached under any PCID. */
+      asm volatile ("invlpg (%0)" ::"r"(virt_addr) : "memory");
+      if (cpu_features.pcid && !cpu_features.pge)
+        {
+          pcid_generation++;
+          next_pcid = 1;
+        }
+    }
+  else if (pagemap == current_pagemap)
+    {
+      asm volatile ("invlpg (%0)" ::"r"(virt_addr) : "memory");
+    }
+  else
+    {
+      vmm_flush_pagemap (pagemap);
+    }
 }
 
 void
@@ -253,11 +522,12 @@ vmm_init (void)
       panic ("vmm_init: failed to allocate kernel plm4");
     }
   uint64_t *pml4_virt = (uint64_t *)((uintptr_t)pml4_phys + VMM_HIGHER_HALF);
-  memset (pml4_virt, 0, PAGE_SIZE);
 
   static pagemap_t k_pagemap;
   kernel_pagemap = &k_pagemap;
   kernel_pagemap->top_level = pml4_virt;
+  kernel_pagemap->regions = NULL;
+  kernel_pagemap->pcid_generation = 0;
 
   struct limine_executable_address_response *kaddr
       = kernel_address_request.response;
@@ -273,10 +543,13 @@ vmm_init (void)
 
   uintptr_t kernel_virt_end = data_end_addr;
 
-  for (uintptr_t p_virt = kernel_virt_base; p_virt < kernel_virt_end;
+  /* Pages with the same protection are collected into runs so that
+   * suitably aligned parts of a segment can use large pages */
+  uintptr_t run_virt = kernel_virt_base;
+  uint64_t run_flags = 0;
+  for (uintptr_t p_virt = kernel_virt_base; p_virt <= kernel_virt_end;
        p_virt += PAGE_SIZE)
     {
-      uintptr_t p_phys = (p_virt - kernel_virt_base) + kernel_phys_base;
       uint64_t flags = PTE_PRESENT;
 
       if (p_virt >= text_start_addr && p_virt < text_end_addr)
@@ -295,10 +568,22 @@ vmm_init (void)
           flags |= PTE_WRITABLE | PTE_NX;
         }
 
-      if (!vmm_map_page (kernel_pagemap, p_virt, p_phys, flags))
+      if (p_virt == kernel_virt_base)
+        {
+          run_flags = flags;
+          continue;
+        }
+      if (p_virt < kernel_virt_end && flags == run_flags)
+        continue;
+
+      uintptr_t run_phys = (run_virt - kernel_virt_base) + kernel_phys_base;
+      if (!vmm_map_contiguous (kernel_pagemap, run_virt, run_phys,
+                               p_virt - run_virt, run_flags))
         {
           panic ("vmm_init: failed to map kernel page");
         }
+      run_virt = p_virt;
+      run_flags = flags;
     }
 
   struct limine_memmap_response *memmap = memmap_request.response;
@@ -314,13 +599,11 @@ vmm_init (void)
       if (map_top <= map_base)
         continue;
 
-      for (uintptr_t p = map_base; p < map_top; p += PAGE_SIZE)
+      if (!vmm_map_contiguous (kernel_pagemap, map_base + VMM_HIGHER_HALF,
+                               map_base, map_top - map_base,
+                               PTE_PRESENT | PTE_WRITABLE | PTE_NX))
         {
-          if (!vmm_map_page (kernel_pagemap, p + VMM_HIGHER_HALF, p,
-                             PTE_PRESENT | PTE_WRITABLE | PTE_NX))
-            {
-              panic ("vmm_init: failed to map hhdm page");
-            }
+          panic ("vmm_init: failed to map hhdm page");
         }
 
       const uintptr_t IDENTITY_MAP_LIMIT = 0x00100000;
@@ -328,13 +611,11 @@ vmm_init (void)
         {
           uintptr_t identity_top
               = (map_top > IDENTITY_MAP_LIMIT) ? IDENTITY_MAP_LIMIT : map_top;
-          for (uintptr_t p = map_base; p < identity_top; p += PAGE_SIZE)
+          if (!vmm_map_range (kernel_pagemap, map_base, map_base,
+                              identity_top - map_base,
+                              PTE_PRESENT | PTE_WRITABLE | PTE_NX))
             {
-              if (!vmm_map_page (kernel_pagemap, p, p,
-                                 PTE_PRESENT | PTE_WRITABLE | PTE_NX))
-                {
-                  panic ("vmm_init: failed to identity map low page");
-                }
+              panic ("vmm_init: failed to identity map low page");
             }
         }
     }
@@ -0,0 +1,325 @@
+/*-
+ * SPDX-License-Identifier: 0BSD
+ *
+ * Copyright (c) 2025 V. Prokopenko
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <x86_64/page.h>
+#include <x86_64/vmm/vmm_map.h>
+#include <x86_64/vmm/vmm_range.h>
+#include <sys/printk.h>
+
+/* Range versions of vmm_map_page() and vmm_unmap_page(). Instead of walking
+ * PML4 -> PT for every page they walk once per page table (512 pages) and
+ * batch the TLB invalidations in a vmm_tlb_gather_t. Mapping over a
+ * non-present entry needs no invalidation at all. */
+
+#define PT_SPAN (512ull * PAGE_SIZE)
+
+void
+vmm_gather_init (vmm_tlb_gather_t *gather, pagemap_t *pagemap)
+{
+  gather->pagemap = pagemap;
+  gather->page_count = 0;
+  gather->full_flush = false;
+  gather->kernel_half = false;
+  gather->table_count = 0;
+}
+
+void
+vmm_gather_page (vmm_tlb_gather_t *gather, uintptr_t virt_addr)
+{
+  if (virt_addr >= (uintptr_t)VMM_HIGHER_HALF)
+    gather->kernel_half = true;
+  if (gather->full_flush)
+    return;
+  if (gather->page_count == VMM_GATHER_MAX_PAGES)
+    {
+      gather->full_flush = true;
+      return;
+    }
+  gather->pages[gather->page_count++] = virt_addr;
+}
+
+void
+vmm_gather_flush (vmm_tlb_gather_t *gather)
+{
+  if (gather->full_flush && gather->kernel_half)
+    {
+      vmm_flush_all ();
+    }
+  else if (gather->full_flush)
+    {
+      vmm_flush_pagemap (gather->pagemap);
+    }
+  else if (gather->kernel_half || gather->pagemap == current_pagemap)
+    {
+      for (size_t i = 0; i < gather->page_count; i++)
+        vmm_invalidate_page (gather->pagemap, gather->pages[i]);
+    }
+  else if (gather->page_count > 0)
+    {
+      vmm_flush_pagemap (gather->pagemap);
+    }
+
+  /* Page tables can only be reused once nothing caches them anymore */
+  for (size_t i = 0; i < gather->table_count; i++)
+    free_page ((void *)gather->tables[i]);
+
+  gather->page_count = 0;
+  gather->full_flush = false;
+  gather->kernel_half = false;
+  gather->table_count = 0;
+}
+
+static void
+vmm_gather_table (vmm_tlb_gather_t *gather, uintptr_t table_phys)
+{
+  if (gather->table_count == VMM_GATHER_MAX_TABLES)
+    vmm_gather_flush (gather);
+  gather->tables[gather->table_count++] = table_phys;
+}
+
+static bool
+vmm_table_is_empty (uint64_t *table)
+{
+  for (int i = 0; i < 512; i++)
+    {
+      if (table[i] != 0)
+        return false;
+    }
+  return true;
+}
+
+static bool
+vmm_entry_is_large (uint64_t entry)
+{
+  return (entry & (PTE_PRESENT | PTE_PS)) == (PTE_PRESENT | PTE_PS);
+}
+
+/* Walk to the page table covering virt_addr. Returns NULL if it doesn't
+ * exist (and allocate is false) or a large page is in the way; *large tells
+ * the two apart. */
+static uint64_t *
+vmm_range_walk (pagemap_t *pagemap, uintptr_t virt_addr, bool allocate,
+                uint64_t alloc_flags, bool *large)
+{
+  size_t pml4_index = (virt_addr >> 39) & 0x1FF;
+  size_t pdpt_index = (virt_addr >> 30) & 0x1FF;
+  size_t pd_index = (virt_addr >> 21) & 0x1FF;
+
+  *large = false;
+  uint64_t *pdpt = vmm_get_next_level (pagemap->top_level, pml4_index,
+                                       allocate, alloc_flags);
+  if (!pdpt)
+    return NULL;
+  if (vmm_entry_is_large (pdpt[pdpt_index]))
+    {
+      *large = true;
+      return NULL;
+    }
+  uint64_t *pd
+      = vmm_get_next_level (pdpt, pdpt_index, allocate, alloc_flags);
+  if (!pd)
+    return NULL;
+  if (vmm_entry_is_large (pd[pd_index]))
+    {
+      *large = true;
+      return NULL;
+    }
+  return vmm_get_next_level (pd, pd_index, allocate, alloc_flags);
+}
+
+/* Free the page table covering virt_addr and any parents that became empty */
+static void
+vmm_range_free_tables (vmm_tlb_gather_t *gather, uintptr_t virt_addr)
+{
+  uint64_t *pml4 = gather->pagemap->top_level;
+  size_t pml4_index = (virt_addr >> 39) & 0x1FF;
+  size_t pdpt_index = (virt_addr >> 30) & 0x1FF;
+  size_t pd_index = (virt_addr >> 21) & 0x1FF;
+
+  uint64_t *pdpt = vmm_get_next_level (pml4, pml4_index, false, 0);
+  uint64_t *pd = vmm_get_next_level (pdpt, pdpt_index, false, 0);
+  uint64_t *pt = vmm_get_next_level (pd, pd_index, false, 0);
+  if (!vmm_table_is_empty (pt))
+    return;
+
+  vmm_gather_table (gather, PTE_GET_ADDR (pd[pd_index]));
+  pd[pd_index] = 0;
+  if (!vmm_table_is_empty (pd))
+    return;
+
+  vmm_gather_table (gather, PTE_GET_ADDR (pdpt[pdpt_index]));
+  pdpt[pdpt_index] = 0;
+  if (!vmm_table_is_empty (pdpt))
+    return;
+
+  vmm_gather_table (gather, PTE_GET_ADDR (pml4[pml4_index]));
+  pml4[pml4_index] = 0;
+}
+
+bool
+vmm_map_range (pagemap_t *pagemap, uintptr_t virt_addr, uintptr_t phys_addr,
+               size_t length, uint64_t flags)
+{
+  virt_addr &= ~(uintptr_t)(PAGE_SIZE - 1);
+  phys_addr &= ~(uintptr_t)(PAGE_SIZE - 1);
+  uintptr_t end = virt_addr + ALIGN_UP (length, PAGE_SIZE);
+
+  uint64_t alloc_flags = PTE_PRESENT | PTE_WRITABLE;
+  if (flags & PTE_USER)
+    alloc_flags |= PTE_USER;
+  flags = vmm_leaf_flags (virt_addr, flags);
+
+  vmm_tlb_gather_t gather;
+  vmm_gather_init (&gather, pagemap);
+
+  while (virt_addr < end)
+    {
+      bool large;
+      uint64_t *pt
+          = vmm_range_walk (pagemap, virt_addr, true, alloc_flags, &large);
+      if (!pt)
+        {
+          vmm_gather_flush (&gather);
+          printk (large ? "vmm: vmm_map_range: virt %llx is part of a large "
+                          "page\n"
+                        : "vmm: vmm_map_range: failed to map page for virt "
+                          "%llx\n",
+                  (void *)virt_addr);
+          return false;
+        }
+
+      for (size_t i = (virt_addr >> 12) & 0x1FF; i < 512 && virt_addr < end;
+           i++)
+        {
+          if (pt[i] & PTE_PRESENT)
+            vmm_gather_page (&gather, virt_addr);
+          pt[i] = phys_addr | flags | PTE_PRESENT;
+          virt_addr += PAGE_SIZE;
+          phys_addr += PAGE_SIZE;
+        }
+    }
+
+  vmm_gather_flush (&gather);
+  return true;
+}
+
+bool
+vmm_unmap_range (pagemap_t *pagemap, uintptr_t virt_addr, size_t length)
+{
+  if (virt_addr % PAGE_SIZE != 0)
+    {
+      printk ("vmm: vmm_unmap_range: called with non-aligned virt %llx\n",
+              (void *)virt_addr);
+      return false;
+    }
+  uintptr_t end = virt_addr + ALIGN_UP (length, PAGE_SIZE);
+
+  vmm_tlb_gather_t gather;
+  vmm_gather_init (&gather, pagemap);
+
+  while (virt_addr < end)
+    {
+      uintptr_t next = ALIGN_UP (virt_addr + 1, PT_SPAN);
+      bool large;
+      uint64_t *pt = vmm_range_walk (pagemap, virt_addr, false, 0, &large);
+      if (!pt && large)
+        {
+          /* Like vmm_unmap_page(), large pages are not split */
+          vmm_gather_flush (&gather);
+          printk ("vmm: vmm_unmap_range: virt %llx is part of a large page\n",
+                  (void *)virt_addr);
+          return false;
+        }
+      if (!pt)
+        {
+          virt_addr = next;
+          continue;
+        }
+
+      bool cleared = false;
+      for (size_t i = (virt_addr >> 12) & 0x1FF; i < 512 && virt_addr < end;
+           i++)
+        {
+          if (pt[i] & PTE_PRESENT)
+            {
+              pt[i] = 0;
+              vmm_gather_page (&gather, virt_addr);
+              cleared = true;
+            }
+          virt_addr += PAGE_SIZE;
+        }
+
+      if (cleared)
+        vmm_range_free_tables (&gather, next - PAGE_SIZE);
+    }
+
+  vmm_gather_flush (&gather);
+  return true;
+}
+
+bool
+vmm_protect_range (pagemap_t *pagemap, uintptr_t virt_addr, size_t length,
+                   uint64_t flags)
+{
+  virt_addr &= ~(uintptr_t)(PAGE_SIZE - 1);
+  uintptr_t end = virt_addr + ALIGN_UP (length, PAGE_SIZE);
+  flags = vmm_leaf_flags (virt_addr, flags);
+
+  vmm_tlb_gather_t gather;
+  vmm_gather_init (&gather, pagemap);
+
+  while (virt_addr < end)
+    {
+      uintptr_t next = ALIGN_UP (virt_addr + 1, PT_SPAN);
+      bool large;
+      uint64_t *pt = vmm_range_walk (pagemap, virt_addr, false, 0, &large);
+      if (!pt && large)
+        {
+          /* Like vmm_unmap_page(), large pages are not split */
+          vmm_gather_flush (&gather);
+          printk ("vmm: vmm_protect_range: virt %llx is part of a large page\n",
+                  (void *)virt_addr);
+          return false;
+        }
+      if (!pt)
+        {
+          virt_addr = next;
+          continue;
+        }
+
+      for (size_t i = (virt_addr >> 12) & 0x1FF; i < 512 && virt_addr < end;
+           i++)
+        {
+          if (pt[i] & PTE_PRESENT)
+            {
+              uint64_t entry = PTE_GET_ADDR (pt[i]) | flags | PTE_PRESENT;
+              if (entry != pt[i])
+                {
+                  pt[i] = entry;
+                  vmm_gather_page (&gather, virt_addr);
+                }
+            }
+          virt_addr += PAGE_SIZE;
+        }
+    }
+
+  vmm_gather_flush (&gather);
+  return true;
+}
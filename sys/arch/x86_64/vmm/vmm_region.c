@@ -0,0 +1,247 @@
+/*-
+ * SPDX-License-Identifier: 0BSD
+ *
+ * Copyright (c) 2025 V. Prokopenko
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <x86_64/heap.h>
+#include <x86_64/page.h>
+#include <x86_64/vmm/vmm_map.h>
+#include <x86_64/vmm/vmm_range.h>
+#include <x86_64/vmm/vmm_region.h>
+#include <sys/printk.h>
+
+/* Demand paging. A pagemap keeps a sorted list of reserved regions; nothing
+ * in them is mapped up front. The first access to a page faults, and the page
+ * fault handler asks vmm_handle_demand_fault() to back it with a zeroed page.
+ * Big reservations (heaps, stacks, sparse arrays) only cost what is used. */
+
+static pagemap_t *
+vmm_region_owner (pagemap_t *pagemap, uintptr_t virt_addr)
+{
+  if (virt_addr >= (uintptr_t)VMM_HIGHER_HALF)
+    return kernel_pagemap;
+  return pagemap;
+}
+
+bool
+vmm_reserve (pagemap_t *pagemap, uintptr_t base, size_t length,
+             uint64_t flags)
+{
+  if (base % PAGE_SIZE != 0 || length == 0 || length % PAGE_SIZE != 0
+      || base + length < base)
+    {
+      printk ("vmm: vmm_reserve: bad range %llx\n", (void *)base);
+      return false;
+    }
+
+  pagemap = vmm_region_owner (pagemap, base);
+
+  vmm_region_t *prev = NULL;
+  vmm_region_t *next = pagemap->regions;
+  while (next && next->base < base)
+    {
+      prev = next;
+      next = next->next;
+    }
+
+  if ((prev && prev->base + prev->length > base)
+      || (next && base + length > next->base))
+    {
+      printk ("vmm: vmm_reserve: %llx overlaps another region\n",
+              (void *)base);
+      return false;
+    }
+
+  vmm_region_t *region = kmalloc (sizeof (vmm_region_t));
+  if (!region)
+    return false;
+
+  region->base = base;
+  region->length = length;
+  region->flags = flags;
+  region->next = next;
+  if (prev)
+    prev->next = region;
+  else
+    pagemap->regions = region;
+  return true;
+}
+
+/* Drop whatever has been faulted in between base and base + length */
+static void
+vmm_region_unback (pagemap_t *pagemap, uintptr_t base, size_t length)
+{
+  for (uintptr_t virt = base; virt < base + length; virt += PAGE_SIZE)
+    {
+      uint64_t *pte = vmm_get_pte (pagemap, virt, false);
+      if (pte && (*pte & PTE_PRESENT))
+        page_unref (PTE_GET_ADDR (*pte));
+    }
+  vmm_unmap_range (pagemap, base, length);
+}
+
+bool
+vmm_release (pagemap_t *pagemap, uintptr_t base)
+{
+  pagemap = vmm_region_owner (pagemap, base);
+
+  vmm_region_t **link = &pagemap->regions;
+  while (*link && (*link)->base != base)
+    link = &(*link)->next;
+
+  vmm_region_t *region = *link;
+  if (!region)
+    {
+      printk ("vmm: vmm_release: no region at %llx\n", (void *)base);
+      return false;
+    }
+  *link = region->next;
+
+  vmm_region_unback (pagemap, base, region->length);
+
+  kfree (region);
+  return true;
+}
+
+bool
+vmm_resize (pagemap_t *pagemap, uintptr_t base, size_t length)
+{
+  if (length == 0 || length % PAGE_SIZE != 0 || base + length < base)
+    {
+      printk ("vmm: vmm_resize: bad length %llx\n", (void *)length);
+      return false;
+    }
+
+  pagemap = vmm_region_owner (pagemap, base);
+
+  vmm_region_t *region = pagemap->regions;
+  while (region && region->base != base)
+    region = region->next;
+
+  if (!region)
+    {
+      printk ("vmm: vmm_resize: no region at %llx\n", (void *)base);
+      return false;
+    }
+
+  if (length > region->length)
+    {
+      if (region->next && base + length > region->next->base)
+        return false;
+    }
+  else if (length < region->length)
+    {
+      vmm_region_unback (pagemap, base + length, region->length - length);
+    }
+
+  region->length = length;
+  return true;
+}
+
+vmm_region_t *
+vmm_find_region (pagemap_t *pagemap, uintptr_t virt_addr)
+{
+  pagemap = vmm_region_owner (pagemap, virt_addr);
+
+  for (vmm_region_t *region = pagemap->regions; region; region = region->next)
+    {
+      if (virt_addr < region->base)
+        break;
+      if (virt_addr - region->base < region->length)
+        return region;
+    }
+  return NULL;
+}
+
+bool
+vmm_copy_regions (pagemap_t *dst, pagemap_t *src)
+{
+  vmm_region_t **tail = &dst->regions;
+  for (vmm_region_t *region = src->regions; region; region = region->next)
+    {
+      if (region->base >= (uintptr_t)VMM_HIGHER_HALF)
+        continue;
+
+      vmm_region_t *copy = kmalloc (sizeof (vmm_region_t));
+      if (!copy)
+        return false;
+      *copy = *region;
+      copy->next = NULL;
+      *tail = copy;
+      tail = &copy->next;
+    }
+  return true;
+}
+
+void
+vmm_free_regions (pagemap_t *pagemap)
+{
+  vmm_region_t *region = pagemap->regions;
+  while (region)
+    {
+      vmm_region_t *next = region->next;
+      kfree (region);
+      region = next;
+    }
+  pagemap->regions = NULL;
+}
+
+bool
+vmm_handle_demand_fault (pagemap_t *pagemap, uintptr_t virt_addr, bool write,
+                         bool user)
+{
+  vmm_region_t *region = vmm_find_region (pagemap, virt_addr);
+  if (!region)
+    return false;
+  if ((write && !(region->flags & PTE_WRITABLE))
+      || (user && !(region->flags & PTE_USER)))
+    return false;
+
+  pagemap_t *owner = vmm_region_owner (pagemap, virt_addr);
+  virt_addr &= ~(uintptr_t)(PAGE_SIZE - 1);
+
+  /* The page may already be there, the fault then only came from a missing
+   * PML4 entry below */
+  uint64_t *pte = vmm_get_pte (owner, virt_addr, false);
+  if (!pte || !(*pte & PTE_PRESENT))
+    {
+      /* Comes from the pre-zeroed pool most of the time */
+      void *phys = allocate_page ();
+      if (!phys)
+        {
+          printk ("vmm: vmm_handle_demand_fault: out of memory\n");
+          return false;
+        }
+
+      if (!vmm_map_page (owner, virt_addr, (uintptr_t)phys, region->flags))
+        {
+          free_page (phys);
+          return false;
+        }
+    }
+
+  /* Pagemaps share the kernel half by copying the kernel's PML4 entries
+   * when they are created. One that predates the entry has to pick it up
+   * now, or the access faults again. */
+  if (owner != pagemap)
+    {
+      size_t pml4_index = (virt_addr >> 39) & 0x1FF;
+      pagemap->top_level[pml4_index] = owner->top_level[pml4_index];
+    }
+  return true;
+}
@@ -18,6 +18,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#include <x86_64/cpu.h>
 #include <x86_64/heap.h>
 #include <atkbd.h>
 #include <atkbd_keymap.h>
@@ -59,11 +60,12 @@ bool caps_lock = false;
 /* Current state of LEDS */
 uint8_t current_led_mask = 0x00;
 
-/* Add a character to the buffer*/
+/* Add a character to the buffer. Called from the keyboard and UART
+ * interrupts, so it must not turn interrupts on behind their back */
 void
 atkbd_add_buffer (char ch)
 {
-  asm volatile ("cli");
+  uint64_t flags = cpu_irq_save ();
 
   if ((buffer_end + 1) != buffer_start)
     {
@@ -72,15 +74,16 @@ atkbd_add_buffer (char ch)
     }
   else
     {
-      buffer_allocs++;
-      char *key_buffer_tmp = kmalloc (4096 * buffer_allocs);
-      memcpy ((void *)key_buffer_tmp, (void *)key_buffer,
-              4096 * (buffer_allocs - 1));
-      kfree ((void *)key_buffer);
-      key_buffer = key_buffer_tmp;
+      /* Usually extends in place, see krealloc() */
+      char *key_buffer_tmp = krealloc (key_buffer, 4096 * (buffer_allocs + 1));
+      if (key_buffer_tmp)
+        {
+          buffer_allocs++;
+          key_buffer = key_buffer_tmp;
+        }
     }
 
-  asm volatile ("sti");
+  cpu_irq_restore (flags);
 }
 
 /* Clear the buffer */
@@ -21,3 +21,7 @@ void atkbd_init ();
 void atkbd_enable ();
 void atkbd_disable ();
 char atkbd_get_char ();
+
+/* Queue a typed character for readers of /dev/kbd */
+void atkbd_add_buffer (char ch);
+int atkbd_read (char *node, void *buf, int size);
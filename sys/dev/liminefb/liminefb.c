@@ -20,10 +20,13 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <x86_64/cpu.h>
+#include <x86_64/heap.h>
 #include <x86_64/request.h>
 #include <liminefb.h>
 #include <sys/printk.h>
 #include <sys/mount.h>
+#include <sys/string.h>
 
 /* Technically, you can use another font by just changing up the symbol names,
  * however, it must be 8x16, since some numbers are hardcoded here. It also
@@ -53,6 +56,128 @@ uint32_t bg_color = 0x00000000;
 struct psf1_header *font
     = (struct psf1_header *)&_binary_lib_viscii10_8x16_psf_start;
 
+/*
+ * Shadow framebuffer
+ *
+ * Once the heap is up, all drawing goes to a copy of the framebuffer in
+ * RAM, and the rectangles that changed are copied to the real one when a
+ * write is done (liminefb_flush()). VRAM is then only ever written, in
+ * whole aligned rows, and scrolling is a memmove() in RAM. Until
+ * liminefb_shadow_init() runs, fb_draw is the framebuffer itself.
+ */
+
+#define FB_DIRTY_MAX 8
+
+typedef struct
+{
+  int x0, y0, x1, y1; /* pixels, x1 and y1 exclusive */
+} fb_rect_t;
+
+static uint32_t *fb_draw;
+static uint32_t *fb_shadow = NULL;
+
+static fb_rect_t fb_dirty[FB_DIRTY_MAX];
+static int fb_dirty_count = 0;
+
+static struct
+{
+  uint64_t chars;
+  uint64_t scrolls;
+  uint64_t flushes;
+  uint64_t flush_bytes;
+  uint64_t flush_cycles;
+} fb_stats;
+
+static void
+fb_rect_union (fb_rect_t *r, const fb_rect_t *with)
+{
+  if (with->x0 < r->x0)
+    r->x0 = with->x0;
+  if (with->y0 < r->y0)
+    r->y0 = with->y0;
+  if (with->x1 > r->x1)
+    r->x1 = with->x1;
+  if (with->y1 > r->y1)
+    r->y1 = with->y1;
+}
+
+/* Note that a rectangle of the shadow buffer changed. Rectangles that
+ * overlap or touch one already in the list are merged into it; when the
+ * list is full, everything is merged into one. */
+static void
+fb_mark_dirty (int x, int y, int w, int h)
+{
+  if (!fb_shadow)
+    return;
+
+  fb_rect_t rect = { x, y, x + w, y + h };
+  if (rect.x0 < 0)
+    rect.x0 = 0;
+  if (rect.y0 < 0)
+    rect.y0 = 0;
+  if (rect.x1 > fb_width)
+    rect.x1 = fb_width;
+  if (rect.y1 > fb_height)
+    rect.y1 = fb_height;
+  if (rect.x0 >= rect.x1 || rect.y0 >= rect.y1)
+    return;
+
+  for (int i = 0; i < fb_dirty_count; i++)
+    {
+      fb_rect_t *r = &fb_dirty[i];
+      if (rect.x0 <= r->x1 && rect.x1 >= r->x0 && rect.y0 <= r->y1
+          && rect.y1 >= r->y0)
+        {
+          fb_rect_union (r, &rect);
+          return;
+        }
+    }
+
+  if (fb_dirty_count == FB_DIRTY_MAX)
+    {
+      for (int i = 1; i < fb_dirty_count; i++)
+        fb_rect_union (&fb_dirty[0], &fb_dirty[i]);
+      fb_rect_union (&fb_dirty[0], &rect);
+      fb_dirty_count = 1;
+      return;
+    }
+  fb_dirty[fb_dirty_count++] = rect;
+}
+
+/* Copy the dirty rectangles to the framebuffer. Rows are widened to 16 byte
+ * boundaries so memcpy() gets to use its widest aligned stores; the
+ * extra pixels are copied from the shadow, so they don't change. */
+void
+liminefb_flush ()
+{
+  if (!fb_shadow || !fb_dirty_count)
+    return;
+
+  uint64_t start = cpu_rdtsc ();
+  int bytes_per_pixel = bpp / 8;
+  for (int i = 0; i < fb_dirty_count; i++)
+    {
+      fb_rect_t *r = &fb_dirty[i];
+      size_t from = (r->x0 * bytes_per_pixel) & ~15;
+      size_t to = (r->x1 * bytes_per_pixel + 15) & ~15;
+      if (to > (size_t)pitch)
+        to = pitch;
+
+      for (int y = r->y0; y < r->y1; y++)
+        {
+          size_t offset = (size_t)y * pitch + from;
+          memcpy ((uint8_t *)fb_addr + offset, (uint8_t *)fb_shadow + offset,
+                  to - from);
+        }
+      fb_stats.flush_bytes += (to - from) * (r->y1 - r->y0);
+    }
+  fb_dirty_count = 0;
+  fb_stats.flushes++;
+  fb_stats.flush_cycles += cpu_rdtsc () - start;
+}
+
+static void liminefb_draw_newline ();
+
 void
 liminefb_erase_cursor ()
 {
@@ -65,9 +190,11 @@ liminefb_erase_cursor ()
           int pixel_index = (cursor_prev_y + font->charsize - cursor_height + y)
                                 * (pitch / (bpp / 8))
                             + (cursor_prev_x + x);
-          fb_addr[pixel_index] = bg_color;
+          fb_draw[pixel_index] = bg_color;
         }
     }
+  fb_mark_dirty (cursor_prev_x, cursor_prev_y + font->charsize - cursor_height,
+                 cursor_width, cursor_height);
 }
 
 void
@@ -75,7 +202,7 @@ liminefb_redraw_cursor ()
 {
   if (cursor_x + 8 > fb_width)
     {
-      liminefb_newline ();
+      liminefb_draw_newline ();
     }
   liminefb_erase_cursor ();
 
@@ -99,9 +226,11 @@ liminefb_redraw_cursor ()
           if (fb_x >= fb_width)
             continue;
 
-          fb_addr[fb_y * row_pixels + fb_x] = 0xFFFFFF;
+          fb_draw[fb_y * row_pixels + fb_x] = 0xFFFFFF;
         }
     }
+  fb_mark_dirty (cursor_x, cursor_y + font->charsize - cursor_height,
+                 cursor_width, cursor_height);
 
   cursor_prev_x = cursor_x;
   cursor_prev_y = cursor_y;
@@ -112,31 +241,22 @@ liminefb_scroll ()
 {
   liminefb_erase_cursor ();
   int char_height = 16;
-  uint8_t *byte_fb = (uint8_t *)fb_addr;
-
-  for (int y = 0; y < fb_height - char_height; y++)
-    {
-      for (int x = 0; x < pitch; x++)
-        {
-          byte_fb[y * pitch + x] = byte_fb[(y + char_height) * pitch + x];
-        }
-    }
+  uint8_t *byte_fb = (uint8_t *)fb_draw;
 
-  for (int y = fb_height - char_height; y < fb_height; y++)
-    {
-      for (int x = 0; x < pitch; x++)
-        {
-          byte_fb[y * pitch + x] = 0;
-        }
-    }
+  memmove (byte_fb, byte_fb + (size_t)char_height * pitch,
+           (size_t)(fb_height - char_height) * pitch);
+  memset (byte_fb + (size_t)(fb_height - char_height) * pitch, 0,
+          (size_t)char_height * pitch);
+  fb_mark_dirty (0, 0, fb_width, fb_height);
+  fb_stats.scrolls++;
 
   cursor_x = 0;
   cursor_y = fb_height - 16;
   liminefb_redraw_cursor ();
 }
 
-void
-liminefb_newline ()
+static void
+liminefb_draw_newline ()
 {
   cursor_x = 0;
   cursor_y += 16;
@@ -150,24 +270,40 @@ liminefb_newline ()
 }
 
 void
-liminefb_erase_char ()
+liminefb_newline ()
+{
+  liminefb_draw_newline ();
+  liminefb_flush ();
+}
+
+static void
+liminefb_draw_erase_char ()
 {
   for (int i = 0; i < 16; i++)
     {
       for (int j = 0; j < 8; j++)
         {
           int px = (cursor_y + i) * (pitch / (bpp / 8)) + (cursor_x + j);
-          fb_addr[px] = 0x000000;
+          fb_draw[px] = 0x000000;
         }
     }
+  fb_mark_dirty (cursor_x, cursor_y, 8, 16);
   liminefb_redraw_cursor ();
 }
 
 void
-liminefb_putchar (char c, uint32_t color)
+liminefb_erase_char ()
+{
+  liminefb_draw_erase_char ();
+  liminefb_flush ();
+}
+
+/* Draw a character into fb_draw without flushing */
+static void
+liminefb_draw_char (char c, uint32_t color)
 {
   if (cursor_x + 8 > fb_width)
-    liminefb_newline ();
+    liminefb_draw_newline ();
   if (cursor_y + 16 > fb_height)
     liminefb_scroll ();
   if (c == '\b')
@@ -175,19 +311,19 @@ liminefb_putchar (char c, uint32_t color)
       if (cursor_x > 0)
         {
           cursor_x -= 8;
-          liminefb_erase_char ();
+          liminefb_draw_erase_char ();
         }
       else if (cursor_y > 0)
         {
           cursor_y -= 16;
           cursor_x = (fb_width / 8 - 1) * 8;
-          liminefb_erase_char ();
+          liminefb_draw_erase_char ();
         }
       return;
     }
   if (c == '\n')
     {
-      liminefb_newline ();
+      liminefb_draw_newline ();
       return;
     }
   uint8_t *glyphs
@@ -195,32 +331,45 @@ liminefb_putchar (char c, uint32_t color)
 
   uint8_t *glyph = glyphs + (c * font->charsize);
 
+  int baseline_offset = 2;
   for (int i = 0; i < font->charsize; i++)
     {
+      /* The top rows of a glyph on the first line are off screen */
+      int fb_y = cursor_y + i - baseline_offset;
+      if (fb_y < 0 || fb_y >= fb_height)
+        continue;
+
       for (int j = 0; j < 8; j++)
         {
           if (glyph[i] & (0x80 >> j))
             {
-              int baseline_offset = 2;
-              int pixel_index
-                  = (cursor_y + i - baseline_offset) * (pitch / (bpp / 8))
-                    + (cursor_x + j);
-              fb_addr[pixel_index] = color;
+              int pixel_index = fb_y * (pitch / (bpp / 8)) + (cursor_x + j);
+              fb_draw[pixel_index] = color;
             }
         }
     }
+  fb_mark_dirty (cursor_x, cursor_y - baseline_offset, 8, font->charsize);
+  fb_stats.chars++;
   cursor_x = cursor_x + 8;
   liminefb_redraw_cursor ();
 }
 
+void
+liminefb_putchar (char c, uint32_t color)
+{
+  liminefb_draw_char (c, color);
+  liminefb_flush ();
+}
+
 void
 liminefb_putstr (char *str, uint32_t color)
 {
   while (*str)
     {
-      liminefb_putchar (*str, color);
+      liminefb_draw_char (*str, color);
       str++;
     }
+  liminefb_flush ();
 }
 
 void
@@ -229,12 +378,32 @@ liminefb_init ()
   const struct limine_framebuffer *framebuffer
       = framebuffer_request.response->framebuffers[0];
   fb_addr = framebuffer->address;
+  fb_draw = fb_addr;
   pitch = framebuffer->pitch;
   bpp = framebuffer->bpp;
   fb_width = framebuffer->width;
   fb_height = framebuffer->height;
 }
 
+void
+liminefb_shadow_init ()
+{
+  size_t size = (size_t)pitch * fb_height;
+  uint32_t *shadow = kmalloc_aligned (size, 64);
+  if (!shadow)
+    {
+      printk (KERN_WARNING "liminefb: no memory for a shadow buffer, drawing "
+                           "to the framebuffer\n");
+      return;
+    }
+
+  /* The last time the framebuffer is read */
+  memcpy (shadow, fb_addr, size);
+  fb_shadow = shadow;
+  fb_draw = shadow;
+  printk ("liminefb: %llu KiB shadow buffer\n", (uint64_t)(size / 1024));
+}
+
 int
 liminefb_write (char *node, void *buffer, int size)
 {
@@ -245,9 +414,38 @@ liminefb_write (char *node, void *buffer, int size)
   return 0;
 }
 
+/* /dev/fbstat: console counters. Throughput is flush_bytes / flush_cycles
+ * times the TSC frequency. */
+int
+fbstat_read (char *data, void *buffer, int size)
+{
+  (void)data; /* unused */
+  char *buf = buffer;
+  int len = 0;
+
+  len += snprintf (buf + len, size - len, "shadow %u\n",
+                   (unsigned int)(fb_shadow != NULL));
+  len += snprintf (buf + len, size - len, "chars %llu scrolls %llu\n",
+                   fb_stats.chars, fb_stats.scrolls);
+  len += snprintf (buf + len, size - len,
+                   "flushes %llu bytes %llu cycles %llu\n", fb_stats.flushes,
+                   fb_stats.flush_bytes, fb_stats.flush_cycles);
+  if (fb_stats.flush_cycles)
+    {
+      len += snprintf (buf + len, size - len, "bytes/kcycle %llu\n",
+                       fb_stats.flush_bytes * 1000 / fb_stats.flush_cycles);
+    }
+
+  return len;
+}
+
 fs_operations_t liminefb_ops = {
   .open = NULL,
   .close = NULL,
   .read = NULL,
   .write = liminefb_write,
-};
\ No newline at end of file
+};
+
+fs_operations_t fbstat_ops = {
+  .read = fbstat_read,
+};
@@ -20,6 +20,13 @@
 #include <stdint.h>
 
 void liminefb_init ();
+
+/* Move drawing to a shadow buffer in RAM. Needs the heap */
+void liminefb_shadow_init ();
+
+/* Copy what changed in the shadow buffer to the framebuffer. The calls
+ * below flush by themselves */
+void liminefb_flush ();
 void liminefb_newline ();
 void liminefb_putchar (char c, uint32_t color);
 void liminefb_putstr (char *str, uint32_t color);
@@ -0,0 +1,266 @@
+/*-
+ * SPDX-License-Identifier: 0BSD
+ *
+ * Copyright (c) 2025 V. Prokopenko
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * 16550 UART on COM1
+ *
+ * Output goes into a ring that the transmitter empties from its interrupt:
+ * whenever the TX FIFO runs empty, THRE raises IRQ 4 and up to a FIFO's
+ * worth of bytes is moved from the ring to the chip. Writers only wait when
+ * the ring is full, or after a panic, when everything is written by polling.
+ *
+ * Received bytes go to the keyboard buffer, so a serial terminal types into
+ * the same place the keyboard does.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atkbd.h>
+#include <uart.h>
+#include <sys/mount.h>
+#include <sys/portb.h>
+#include <sys/printk.h>
+#include <x86_64/cpu.h>
+
+#define COM1 0x3F8
+
+/* Registers, as offsets from the base port */
+#define UART_DATA 0 /* RBR / THR, divisor low with DLAB */
+#define UART_IER 1  /* divisor high with DLAB */
+#define UART_IIR 2  /* FCR on write */
+#define UART_LCR 3
+#define UART_MCR 4
+#define UART_LSR 5
+#define UART_MSR 6
+#define UART_SCR 7
+
+#define IER_RDA 0x01  /* received data available */
+#define IER_THRE 0x02 /* transmit holding register empty */
+#define IER_RLS 0x04  /* receiver line status */
+
+#define IIR_NONE 0x01
+#define IIR_ID(iir) ((iir) & 0x0E)
+#define IIR_MSR 0x00
+#define IIR_THRE 0x02
+#define IIR_RDA 0x04
+#define IIR_RLS 0x06
+#define IIR_TIMEOUT 0x0C
+
+#define FCR_ENABLE 0x01
+#define FCR_CLEAR_RX 0x02
+#define FCR_CLEAR_TX 0x04
+#define FCR_TRIGGER_14 0xC0
+
+#define LCR_8N1 0x03
+#define LCR_DLAB 0x80
+
+#define MCR_DTR 0x01
+#define MCR_RTS 0x02
+#define MCR_OUT2 0x08 /* gates the IRQ line */
+#define MCR_LOOP 0x10
+
+#define LSR_DR 0x01
+#define LSR_THRE 0x20
+
+#define UART_FIFO_SIZE 16
+#define UART_BAUD 115200
+
+#define UART_TX_SIZE 4096 /* power of two */
+
+static bool uart_present = false;
+static uint8_t uart_ier = 0;
+
+static char uart_tx[UART_TX_SIZE];
+static uint32_t uart_tx_head = 0; /* next byte to queue */
+static uint32_t uart_tx_tail = 0; /* next byte to send */
+
+/* Move up to a FIFO's worth of queued bytes to the chip. The caller has
+ * interrupts off and has seen THRE, i.e. an empty TX FIFO. */
+static void
+uart_tx_fill (void)
+{
+  for (int i = 0; i < UART_FIFO_SIZE && uart_tx_tail != uart_tx_head; i++)
+    {
+      outb (COM1 + UART_DATA, uart_tx[uart_tx_tail % UART_TX_SIZE]);
+      uart_tx_tail++;
+    }
+
+  uint8_t ier = uart_tx_tail != uart_tx_head ? uart_ier | IER_THRE
+                                             : uart_ier & ~IER_THRE;
+  if (ier != uart_ier)
+    {
+      uart_ier = ier;
+      outb (COM1 + UART_IER, ier);
+    }
+}
+
+/* Send one FIFO's worth by polling */
+static void
+uart_tx_poll (void)
+{
+  while (!(inb (COM1 + UART_LSR) & LSR_THRE))
+    ;
+  uart_tx_fill ();
+}
+
+static void
+uart_putc (char c)
+{
+  while (uart_tx_head - uart_tx_tail == UART_TX_SIZE)
+    {
+      uart_tx_poll ();
+    }
+  uart_tx[uart_tx_head % UART_TX_SIZE] = c;
+  uart_tx_head++;
+}
+
+/* Queue `size' bytes, turning "\n" into "\r\n". With `sync' set, return
+ * only once all of it has left the ring. */
+static void
+uart_write_bytes (const char *buffer, int size, bool sync)
+{
+  if (!uart_present)
+    return;
+
+  uint64_t flags = cpu_irq_save ();
+  for (int i = 0; i < size; i++)
+    {
+      if (buffer[i] == '\n')
+        uart_putc ('\r');
+      uart_putc (buffer[i]);
+    }
+
+  /* Nothing in flight means no THRE interrupt is coming, so start the
+   * transmitter here */
+  if (!(uart_ier & IER_THRE) && (inb (COM1 + UART_LSR) & LSR_THRE))
+    uart_tx_fill ();
+
+  if (sync)
+    {
+      while (uart_tx_tail != uart_tx_head)
+        uart_tx_poll ();
+    }
+  cpu_irq_restore (flags);
+}
+
+static void
+uart_printk (const char *text, int level, bool sync)
+{
+  (void)level; /* unused */
+  int len = 0;
+  while (text[len])
+    len++;
+  uart_write_bytes (text, len, sync);
+}
+
+void
+uart_irq ()
+{
+  if (!uart_present)
+    return;
+
+  for (;;)
+    {
+      uint8_t iir = inb (COM1 + UART_IIR);
+      if (iir & IIR_NONE)
+        break;
+
+      switch (IIR_ID (iir))
+        {
+        case IIR_RLS:
+          inb (COM1 + UART_LSR);
+          break;
+        case IIR_RDA:
+        case IIR_TIMEOUT:
+          while (inb (COM1 + UART_LSR) & LSR_DR)
+            {
+              char ch = inb (COM1 + UART_DATA);
+              atkbd_add_buffer (ch == '\r' ? '\n' : ch);
+            }
+          break;
+        case IIR_THRE:
+          uart_tx_fill ();
+          break;
+        default:
+          inb (COM1 + UART_MSR);
+          break;
+        }
+    }
+}
+
+int
+uart_write (char *node, void *buffer, int size)
+{
+  (void)node; /* unused */
+  uart_write_bytes (buffer, size, false);
+  return size;
+}
+
+int
+uart_read (char *node, void *buffer, int size)
+{
+  /* Input is shared with the keyboard */
+  return atkbd_read (node, buffer, size);
+}
+
+fs_operations_t uart_ops = {
+  .open = NULL,
+  .close = NULL,
+  .read = uart_read,
+  .write = uart_write,
+};
+
+void
+uart_init ()
+{
+  /* Nothing answers on an absent port: check the scratch register, then
+   * that a byte comes back in loopback mode */
+  outb (COM1 + UART_SCR, 0x5A);
+  if (inb (COM1 + UART_SCR) != 0x5A)
+    {
+      printk ("uart: no COM1\n");
+      return;
+    }
+
+  outb (COM1 + UART_IER, 0);
+  outb (COM1 + UART_LCR, LCR_DLAB);
+  outb (COM1 + UART_DATA, (115200 / UART_BAUD) & 0xFF);
+  outb (COM1 + UART_IER, (115200 / UART_BAUD) >> 8);
+  outb (COM1 + UART_LCR, LCR_8N1);
+  outb (COM1 + UART_IIR,
+        FCR_ENABLE | FCR_CLEAR_RX | FCR_CLEAR_TX | FCR_TRIGGER_14);
+
+  outb (COM1 + UART_MCR, MCR_LOOP | MCR_RTS | MCR_DTR);
+  outb (COM1 + UART_DATA, 0xAE);
+  for (int i = 0; i < 1000 && !(inb (COM1 + UART_LSR) & LSR_DR); i++)
+    ;
+  if (inb (COM1 + UART_DATA) != 0xAE)
+    {
+      printk ("uart: COM1 failed loopback test\n");
+      return;
+    }
+
+  outb (COM1 + UART_MCR, MCR_OUT2 | MCR_RTS | MCR_DTR);
+  uart_ier = IER_RDA | IER_RLS;
+  outb (COM1 + UART_IER, uart_ier);
+  uart_present = true;
+
+  printk ("uart: COM1 at %x, %u baud\n", COM1, UART_BAUD);
+  printk_add_sink (uart_printk);
+}
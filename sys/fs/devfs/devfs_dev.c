@@ -23,9 +23,10 @@
 #include <sys/strcmp.h>
 #include <sys/string.h>
 #include <sys/mount.h>
-#include <x86_64/heap.h>
+#include <x86_64/slab.h>
 
 devfs_node_t *devfs_root = NULL;
+static kmem_cache_t *devfs_node_cache;
 
 /* Read from a node */
 int
@@ -56,7 +57,7 @@ devfs_write (char *node, void *buffer, int size)
 void
 devfs_register (char *name, fs_operations_t *ops, void *data)
 {
-  devfs_node_t *node = kmalloc (sizeof (devfs_node_t));
+  devfs_node_t *node = kmem_cache_alloc (devfs_node_cache);
   if (!node)
     {
       /* This is probably worth a panic */
@@ -99,7 +100,24 @@ devfs_init ()
   extern char key_buffer[];
   extern fs_operations_t kbd_ops;
   extern fs_operations_t liminefb_ops;
+  extern fs_operations_t fbstat_ops;
   extern fs_operations_t random_ops;
+  extern fs_operations_t uart_ops;
+  extern fs_operations_t proc_faults_ops;
+  extern fs_operations_t slabinfo_ops;
+  extern fs_operations_t kmemstat_ops;
+  extern fs_operations_t kmsg_ops;
+  extern fs_operations_t ktrace_ops;
+  extern fs_operations_t ktraceraw_ops;
+#ifdef KMEM_TRACE
+  extern fs_operations_t kmemtrace_ops;
+#endif
+  devfs_node_cache
+      = kmem_cache_create ("devfs_node", sizeof (devfs_node_t), 0, NULL);
+  if (!devfs_node_cache)
+    {
+      panic ("devfs: failed to create node cache");
+    }
   vfs_mount ("devfs", "/dev", "devfs");
   devfs_register ("kbd", &kbd_ops, key_buffer);
 
@@ -122,5 +140,16 @@ devfs_init ()
    * upon /dev/console though.
    */
   devfs_register ("console", &liminefb_ops, NULL);
+  devfs_register ("fbstat", &fbstat_ops, NULL);
   devfs_register ("random", &random_ops, NULL);
+  devfs_register ("ttyS0", &uart_ops, NULL);
+  devfs_register ("faults", &proc_faults_ops, NULL);
+  devfs_register ("slabinfo", &slabinfo_ops, NULL);
+  devfs_register ("kmemstat", &kmemstat_ops, NULL);
+  devfs_register ("kmsg", &kmsg_ops, NULL);
+  devfs_register ("ktrace", &ktrace_ops, NULL);
+  devfs_register ("ktraceraw", &ktraceraw_ops, NULL);
+#ifdef KMEM_TRACE
+  devfs_register ("kmemtrace", &kmemtrace_ops, NULL);
+#endif
 }
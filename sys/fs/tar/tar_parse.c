@@ -17,8 +17,9 @@
 
 #include <stddef.h>
 #include <stdint.h>
-#include <x86_64/heap.h>
+#include <x86_64/slab.h>
 #include <sys/tar/tar_octal.h>
+#include <sys/panic.h>
 #include <sys/printk.h>
 #include <sys/mount.h>
 #include <sys/strcmp.h>
@@ -73,12 +74,23 @@ typedef struct
 tar_file_t tar_files[MAX_TAR_FILES];
 int tar_file_count = 0;
 
+/* Handles are opened and closed on every vfs_read() */
+static kmem_cache_t *tar_fd_cache;
+
 void
 tarfs_init (void *tar_start)
 {
   uint8_t *ptr = (uint8_t *)tar_start;
   tar_file_count = 0;
 
+  if (!tar_fd_cache)
+    {
+      tar_fd_cache
+          = kmem_cache_create ("tar_fd", sizeof (tar_fd_t), 0, NULL);
+      if (!tar_fd_cache)
+        panic ("tarfs: failed to create handle cache");
+    }
+
   while (1)
     {
       tar_header_t *hdr = (tar_header_t *)ptr;
@@ -164,7 +176,7 @@ tarfs_open (char *file)
               printk ("tarfs: tarfs_open: *name is not a file\n");
               return NULL;
             }
-          tar_fd_t *handle = kmalloc (sizeof (tar_fd_t));
+          tar_fd_t *handle = kmem_cache_alloc (tar_fd_cache);
           if (!handle)
             {
               printk ("tarfs: tarfs_open: failed to alloc handle\n");
@@ -185,7 +197,7 @@ tarfs_close (void *fd)
 {
   tar_fd_t *handle = (tar_fd_t *)fd;
   if (handle)
-    kfree (handle);
+    kmem_cache_free (tar_fd_cache, handle);
   return 0;
 }
 
@@ -15,11 +15,17 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/printk.h>
 #include <limine.h>
+#include <x86_64/page.h>
 
 void
 mi_startup ()
 {
   for (;;)
-    asm volatile ("hlt");
+    {
+      printk_flush ();
+      pmm_refill_zero_pool ();
+      asm volatile ("hlt");
+    }
 }
@@ -0,0 +1,183 @@
+/*-
+ * SPDX-License-Identifier: 0BSD
+ *
+ * Copyright (c) 2025 V. Prokopenko
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Binary event tracing
+ *
+ * ktrace() is printk() for hot paths: it stores the format pointer, the raw
+ * arguments and a timestamp in a ring of fixed size records and formats
+ * nothing. /dev/ktrace formats the records when it is read; /dev/ktraceraw
+ * hands them out as they are, for tools/ktrace to format on the host from
+ * the format strings in osiris.elf.
+ *
+ * The ring works like the printk() log: a writer claims a sequence number
+ * with an atomic increment and publishes the record by storing sequence + 1
+ * to its `seq'. When the ring is full the oldest records are overwritten.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/ktrace.h>
+#include <sys/mount.h>
+#include <sys/printk.h>
+#include <sys/string.h>
+#include <x86_64/cpu.h>
+
+#define KTRACE_RECORDS 1024
+
+static ktrace_record_t ktrace_ring[KTRACE_RECORDS];
+static uint64_t ktrace_head = 0; /* next sequence number to hand out */
+
+static uint64_t ktrace_text_seq = 0;
+static uint64_t ktrace_raw_seq = 0;
+
+void
+ktrace_emit (const char *fmt, const uint64_t *args, int nargs)
+{
+  uint64_t seq = __atomic_fetch_add (&ktrace_head, 1, __ATOMIC_RELAXED);
+  ktrace_record_t *record = &ktrace_ring[seq % KTRACE_RECORDS];
+  __atomic_store_n (&record->seq, 0, __ATOMIC_RELAXED);
+  __atomic_signal_fence (__ATOMIC_RELEASE);
+
+  record->tsc = cpu_rdtsc ();
+  record->fmt = (uintptr_t)fmt;
+  record->nargs = nargs;
+  for (int i = 0; i < nargs; i++)
+    {
+      record->args[i] = args[i];
+    }
+  __atomic_store_n (&record->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Copy out the record at *seq, skipping over (and counting in *lost) the
+ * ones that were overwritten before they could be read. Returns false at
+ * the head of the ring or at a record that is still being written. */
+static bool
+ktrace_get (uint64_t *seq, uint64_t *lost, ktrace_record_t *out)
+{
+  for (;;)
+    {
+      uint64_t head = __atomic_load_n (&ktrace_head, __ATOMIC_ACQUIRE);
+      if (*seq >= head)
+        return false;
+      if (head - *seq > KTRACE_RECORDS)
+        {
+          *lost += head - KTRACE_RECORDS - *seq;
+          *seq = head - KTRACE_RECORDS;
+        }
+
+      ktrace_record_t *record = &ktrace_ring[*seq % KTRACE_RECORDS];
+      uint64_t before = __atomic_load_n (&record->seq, __ATOMIC_ACQUIRE);
+      if (before != *seq + 1)
+        {
+          if (before > *seq + 1)
+            {
+              (*seq)++;
+              (*lost)++;
+              continue;
+            }
+          return false;
+        }
+
+      memcpy (out, record, sizeof (*out));
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+      if (__atomic_load_n (&record->seq, __ATOMIC_RELAXED) != before)
+        {
+          (*seq)++;
+          (*lost)++;
+          continue;
+        }
+
+      (*seq)++;
+      return true;
+    }
+}
+
+/* /dev/ktrace: "tsc text" per event, formatted now */
+int
+ktrace_read (char *data, void *buffer, int size)
+{
+  (void)data; /* unused */
+  char *buf = buffer;
+  char text[160];
+  char line[200];
+  int len = 0;
+
+  for (;;)
+    {
+      uint64_t seq = ktrace_text_seq;
+      uint64_t lost = 0;
+      ktrace_record_t record;
+      if (!ktrace_get (&seq, &lost, &record))
+        break;
+
+      if (lost)
+        {
+          int n = snprintf (line, sizeof (line), "# %llu records lost\n",
+                            lost);
+          if (len + n > size)
+            break;
+          memcpy (buf + len, line, n);
+          len += n;
+          ktrace_text_seq = seq - 1;
+        }
+
+      snprintf_raw (text, sizeof (text), (const char *)record.fmt,
+                    record.args, record.nargs);
+      int n = snprintf (line, sizeof (line), "%llu %s\n", record.tsc, text);
+      if (len + n > size)
+        break;
+      memcpy (buf + len, line, n);
+      len += n;
+      ktrace_text_seq = seq;
+    }
+
+  return len;
+}
+
+/* /dev/ktraceraw: whole ktrace_record_t's. Lost records show up as gaps in
+ * the sequence numbers. */
+int
+ktraceraw_read (char *data, void *buffer, int size)
+{
+  (void)data; /* unused */
+  char *buf = buffer;
+  int len = 0;
+
+  while (len + (int)sizeof (ktrace_record_t) <= size)
+    {
+      uint64_t seq = ktrace_raw_seq;
+      uint64_t lost = 0;
+      ktrace_record_t record;
+      if (!ktrace_get (&seq, &lost, &record))
+        break;
+
+      memcpy (buf + len, &record, sizeof (record));
+      len += sizeof (record);
+      ktrace_raw_seq = seq;
+    }
+
+  return len;
+}
+
+fs_operations_t ktrace_ops = {
+  .read = ktrace_read,
+};
+
+fs_operations_t ktraceraw_ops = {
+  .read = ktraceraw_read,
+};
@@ -26,7 +26,7 @@
 #include <sys/string.h>
 #include <sys/tar/tar_parse.h>
 #include <sys/mount.h>
-#include <x86_64/heap.h>
+#include <x86_64/slab.h>
 #include <x86_64/request.h>
 
 #define VFS_TYPE_LENGTH 32
@@ -44,6 +44,18 @@ typedef struct mountpoint
 } mountpoint_t;
 
 mountpoint_t *mountpoints_root;
+static kmem_cache_t *mountpoint_cache;
+
+void
+vfs_init (void)
+{
+  mountpoint_cache
+      = kmem_cache_create ("mountpoint", sizeof (mountpoint_t), 0, NULL);
+  if (!mountpoint_cache)
+    {
+      panic ("vfs: failed to create mountpoint cache");
+    }
+}
 
 /* Create a mountpoint. fs_operations_t is left uninitialised since we do that
  * during vfs_mount
@@ -51,7 +63,7 @@ mountpoint_t *mountpoints_root;
 mountpoint_t *
 vfs_create_mountpoint (char *device, char *target, char *type)
 {
-  mountpoint_t *mp = (mountpoint_t *)kmalloc (sizeof (mountpoint_t));
+  mountpoint_t *mp = kmem_cache_alloc (mountpoint_cache);
   if (!mp)
     {
       printk ("vfs: mountpoint_t: failed to alloc for mountpoint\n");
@@ -96,7 +108,7 @@ vfs_remove_mountpoint (mountpoint_t *mp)
   if (mountpoints_root == mp)
     {
       mountpoints_root = mp->next;
-      kfree (mp);
+      kmem_cache_free (mountpoint_cache, mp);
       return;
     }
 
@@ -107,7 +119,7 @@ vfs_remove_mountpoint (mountpoint_t *mp)
   if (prev->next == mp)
     {
       prev->next = mp->next;
-      kfree (mp);
+      kmem_cache_free (mountpoint_cache, mp);
     }
 }
 
@@ -22,13 +22,9 @@
 #include <stdint.h>
 
 #include <atkbd.h>
+#include <sys/panic.h>
 #include <sys/printk.h>
-
-struct ksym
-{
-  uint64_t addr;
-  const char *name;
-};
+#include <x86_64/cpu.h>
 
 struct ksym ksyms[] = {
 #include "sys/ksyms.h"
@@ -131,15 +127,6 @@ odb_dump_registers (registers_t *regs)
   printk ("FLAGS:0x%llx\n", regs->rflags);
 }
 
-void
-cpuid (uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx,
-       uint32_t *edx)
-{
-  asm volatile ("cpuid"
-                : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
-                : "a"(leaf));
-}
-
 void
 odb_cpuid ()
 {
@@ -171,7 +158,8 @@ panic (const char *fmt)
 {
   odb_read_registers (&regs);
   asm volatile ("cli");
-  printk ("panic: %s\n", fmt);
+  printk_panic ();
+  printk (KERN_EMERG "panic: %s\n", fmt);
   odb_enter ();
   printk ("FATAL: halting system\n");
   for (;;)
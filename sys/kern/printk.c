@@ -16,12 +16,58 @@
  */
 
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <liminefb.h>
+#include <sys/mount.h>
 #include <sys/printk.h>
+#include <sys/string.h>
+#include <x86_64/cpu.h>
 
-int
-vsnprintf (char *buffer, int size, const char *fmt, va_list args)
+/* Where the formatter takes its arguments from: a va_list for printk() and
+ * friends, or the raw 64 bit values a ktrace() record holds */
+typedef struct
+{
+  va_list *ap;
+  const uint64_t *raw;
+  int nraw;
+} fmt_args_t;
+
+enum
+{
+  FMT_INT,
+  FMT_UINT,
+  FMT_U64,
+  FMT_PTR
+};
+
+static uint64_t
+fmt_next (fmt_args_t *args, int type)
+{
+  if (!args->ap)
+    {
+      /* A trace record may hold fewer arguments than its format asks for */
+      if (args->nraw <= 0)
+        return 0;
+      args->nraw--;
+      return *args->raw++;
+    }
+
+  switch (type)
+    {
+    case FMT_INT:
+      return va_arg (*args->ap, int);
+    case FMT_UINT:
+      return va_arg (*args->ap, unsigned int);
+    case FMT_PTR:
+      return (uintptr_t)va_arg (*args->ap, void *);
+    default:
+      return va_arg (*args->ap, uint64_t);
+    }
+}
+
+static int
+format (char *buffer, int size, const char *fmt, fmt_args_t *args)
 {
   char *buf = buffer;
   while (*fmt && (buf - buffer) < size - 1)
@@ -35,13 +81,15 @@ vsnprintf (char *buffer, int size, const char *fmt, va_list args)
       fmt++;
       if (*fmt == 's')
         {
-          char *s = va_arg (args, char *);
+          const char *s = (const char *)(uintptr_t)fmt_next (args, FMT_PTR);
+          if (!s)
+            s = "(null)";
           while (*s && (buf - buffer) < size - 1)
             *buf++ = *s++;
         }
       else if (*fmt == 'd' || *fmt == 'x')
         {
-          int num = va_arg (args, int);
+          int num = (int)fmt_next (args, FMT_INT);
           int base = (*fmt == 'x') ? 16 : 10;
           char tmp[11];
           int i = 0;
@@ -50,7 +98,7 @@ vsnprintf (char *buffer, int size, const char *fmt, va_list args)
               tmp[i++] = "0123456789ABCDEF"[num % base];
               num /= base;
             }
-          while (i--)
+          while (i-- && (buf - buffer) < size - 1)
             {
               *buf++ = tmp[i];
             }
@@ -61,12 +109,12 @@ vsnprintf (char *buffer, int size, const char *fmt, va_list args)
           uint64_t num;
           if (*fmt == 'u')
             {
-              num = va_arg (args, unsigned int);
+              num = (unsigned int)fmt_next (args, FMT_UINT);
             }
           else
             {
               fmt += 2;
-              num = va_arg (args, unsigned long long);
+              num = fmt_next (args, FMT_U64);
             }
           char tmp[21];
           int i = 0;
@@ -77,13 +125,13 @@ vsnprintf (char *buffer, int size, const char *fmt, va_list args)
               tmp[i++] = "0123456789"[num % 10];
               num /= 10;
             }
-          while (i--)
+          while (i-- && (buf - buffer) < size - 1)
             *buf++ = tmp[i];
         }
       else if (*fmt == 'l' && *(fmt + 1) == 'l' && *(fmt + 2) == 'x')
         {
           fmt += 2;
-          uint64_t num = va_arg (args, uint64_t);
+          uint64_t num = fmt_next (args, FMT_U64);
           char tmp[17];
           int i = 0;
           if (num == 0)
@@ -100,7 +148,7 @@ vsnprintf (char *buffer, int size, const char *fmt, va_list args)
             {
               tmp[i++] = '0';
             }
-          while (i--)
+          while (i-- && (buf - buffer) < size - 1)
             *buf++ = tmp[i];
         }
       else
@@ -113,13 +161,311 @@ vsnprintf (char *buffer, int size, const char *fmt, va_list args)
   return buf - buffer;
 }
 
+int
+vsnprintf (char *buffer, int size, const char *fmt, va_list args)
+{
+  va_list ap;
+  va_copy (ap, args);
+  fmt_args_t fmt_args = { .ap = &ap };
+  int len = format (buffer, size, fmt, &fmt_args);
+  va_end (ap);
+  return len;
+}
+
+int
+snprintf_raw (char *buffer, int size, const char *fmt, const uint64_t *args,
+              int nargs)
+{
+  fmt_args_t fmt_args = { .raw = args, .nraw = nargs };
+  return format (buffer, size, fmt, &fmt_args);
+}
+
+int
+snprintf (char *buffer, int size, const char *fmt, ...)
+{
+  va_list args;
+  va_start (args, fmt);
+  int len = vsnprintf (buffer, size, fmt, args);
+  va_end (args);
+  return len;
+}
+
+/*
+ * The kernel log
+ *
+ * printk() only formats its message and copies it into a fixed ring of
+ * records; drawing it on the console happens later, when printk_flush()
+ * runs from the idle loop. Until the idle loop first flushes, and again
+ * after a panic, printk() flushes right away so nothing is lost.
+ *
+ * Writers never block. A writer claims a sequence number with an atomic
+ * increment, clears the slot's `seq', fills in the record and publishes it
+ * by storing sequence + 1 to `seq'. Readers check `seq' before and after
+ * copying a record out and skip it if it changed in between, i.e. the
+ * slot got reused by a writer that lapped them.
+ *
+ * A message longer than one record's text is split over consecutive
+ * records, all but the last marked `cont'. Consoles just print the pieces
+ * one after the other.
+ */
+
+#define LOG_RECORDS 256
+#define LOG_TEXT_SIZE 232
+
+typedef struct
+{
+  uint64_t seq; /* sequence number + 1 once written, 0 while being written */
+  uint64_t tsc;
+  uint16_t len;
+  uint8_t level;
+  uint8_t cont; /* the message goes on in the next record */
+  char text[LOG_TEXT_SIZE];
+} log_record_t;
+
+static log_record_t log_ring[LOG_RECORDS];
+static uint64_t log_head = 0; /* next sequence number to hand out */
+
+/* Consoles the log is drawn on, each with its own read position */
+#define LOG_SINKS 4
+
+typedef struct
+{
+  printk_sink_t write;
+  uint64_t seq;
+  uint64_t lost;
+} log_sink_t;
+
+static void
+log_fb_write (const char *text, int level, bool sync)
+{
+  (void)sync; /* the framebuffer is always synchronous */
+  liminefb_putstr ((char *)text, level <= LOG_ERR ? 0xFF5555 : 0xD3D3D3);
+}
+
+static log_sink_t log_sinks[LOG_SINKS] = { { log_fb_write, 0, 0 } };
+static int log_sink_count = 1;
+static bool log_console_busy = false;
+static bool log_deferred = false;
+static bool log_panicking = false;
+
+static uint64_t log_kmsg_seq = 0;
+
+/* Copy out the record at *seq. Returns false when there is nothing (yet)
+ * to read. Records overwritten before they could be read are skipped and
+ * counted in *lost. A record still being written stops the reader, unless
+ * `force' is set, as a panic can't wait for the interrupted writer. */
+static bool
+log_read (uint64_t *seq, uint64_t *lost, log_record_t *out, bool force)
+{
+  for (;;)
+    {
+      uint64_t head = __atomic_load_n (&log_head, __ATOMIC_ACQUIRE);
+      if (*seq >= head)
+        return false;
+      if (head - *seq > LOG_RECORDS)
+        {
+          *lost += head - LOG_RECORDS - *seq;
+          *seq = head - LOG_RECORDS;
+        }
+
+      log_record_t *record = &log_ring[*seq % LOG_RECORDS];
+      uint64_t before = __atomic_load_n (&record->seq, __ATOMIC_ACQUIRE);
+      if (before != *seq + 1)
+        {
+          if (before > *seq + 1 || force)
+            {
+              (*seq)++;
+              (*lost)++;
+              continue;
+            }
+          return false;
+        }
+
+      memcpy (out, record, sizeof (*out));
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+      if (__atomic_load_n (&record->seq, __ATOMIC_RELAXED) != before)
+        {
+          (*seq)++;
+          (*lost)++;
+          continue;
+        }
+
+      (*seq)++;
+      return true;
+    }
+}
+
+static void
+log_console_drain (bool force)
+{
+  log_record_t record;
+  for (int i = 0; i < log_sink_count; i++)
+    {
+      log_sink_t *sink = &log_sinks[i];
+      while (log_read (&sink->seq, &sink->lost, &record, force))
+        {
+          if (sink->lost)
+            {
+              char note[48];
+              snprintf (note, sizeof (note), "[%llu log messages lost]\n",
+                        sink->lost);
+              sink->write (note, LOG_ERR, force);
+              sink->lost = 0;
+            }
+          record.text[LOG_TEXT_SIZE - 1] = '\0';
+          sink->write (record.text, record.level, force);
+        }
+    }
+}
+
+static void
+log_console_flush (void)
+{
+  if (__atomic_exchange_n (&log_console_busy, true, __ATOMIC_ACQUIRE))
+    return;
+  log_console_drain (false);
+  __atomic_store_n (&log_console_busy, false, __ATOMIC_RELEASE);
+}
+
+void
+printk_flush (void)
+{
+  log_deferred = true;
+  log_console_flush ();
+}
+
+void
+printk_add_sink (printk_sink_t write)
+{
+  uint64_t head = __atomic_load_n (&log_head, __ATOMIC_ACQUIRE);
+  if (log_sink_count == LOG_SINKS)
+    {
+      printk (KERN_ERR "printk: too many consoles\n");
+      return;
+    }
+
+  /* Start with the oldest record still around */
+  log_sink_t *sink = &log_sinks[log_sink_count];
+  sink->seq = head > LOG_RECORDS ? head - LOG_RECORDS : 0;
+  sink->lost = sink->seq;
+  sink->write = write;
+  __atomic_store_n (&log_sink_count, log_sink_count + 1, __ATOMIC_RELEASE);
+
+  if (!log_deferred)
+    {
+      log_console_flush ();
+    }
+}
+
+void
+printk_panic (void)
+{
+  /* Whoever held the console is not coming back */
+  log_panicking = true;
+  log_deferred = false;
+  log_console_drain (true);
+}
+
 void
 printk (const char *fmt, ...)
 {
-  char buffer[1000];
+  int level = LOG_INFO;
+  if (fmt[0] == '\001' && fmt[1] >= '0' && fmt[1] <= '7')
+    {
+      level = fmt[1] - '0';
+      fmt += 2;
+    }
+
+  char buffer[PRINTK_MAX];
   va_list args;
   va_start (args, fmt);
-  vsnprintf (buffer, sizeof (buffer), fmt, args);
+  int len = vsnprintf (buffer, sizeof (buffer), fmt, args);
   va_end (args);
-  liminefb_putstr (buffer, 0xD3D3D3);
-}
\ No newline at end of file
+  if (len == sizeof (buffer) - 1 && buffer[len - 1] != '\n')
+    {
+      /* Cut short; at least don't run into the next message */
+      buffer[len - 1] = '\n';
+    }
+
+  /* Claim all the records at once so the pieces stay together */
+  int chunk = LOG_TEXT_SIZE - 1;
+  int count = len ? (len + chunk - 1) / chunk : 1;
+  uint64_t seq = __atomic_fetch_add (&log_head, count, __ATOMIC_RELAXED);
+  uint64_t tsc = cpu_rdtsc ();
+  for (int i = 0; i < count; i++, seq++)
+    {
+      log_record_t *record = &log_ring[seq % LOG_RECORDS];
+      __atomic_store_n (&record->seq, 0, __ATOMIC_RELAXED);
+      __atomic_signal_fence (__ATOMIC_RELEASE);
+
+      int n = len - i * chunk < chunk ? len - i * chunk : chunk;
+      memcpy (record->text, buffer + i * chunk, n);
+      record->text[n] = '\0';
+      record->tsc = tsc;
+      record->len = n;
+      record->level = level;
+      record->cont = i + 1 < count;
+      __atomic_store_n (&record->seq, seq + 1, __ATOMIC_RELEASE);
+    }
+
+  if (log_panicking)
+    {
+      log_console_drain (true);
+    }
+  else if (!log_deferred)
+    {
+      log_console_flush ();
+    }
+}
+
+/* /dev/kmsg: "level,sequence,tsc,flag;text" per record, the flag being 'c'
+ * when the message goes on in the next record and '-' otherwise. Every
+ * record ends its line, whether or not its text does. Reading consumes, there is one read
+ * position for everyone. */
+int
+kmsg_read (char *data, void *buffer, int size)
+{
+  (void)data; /* unused */
+  char *buf = buffer;
+  char line[LOG_TEXT_SIZE + 48];
+  int len = 0;
+
+  for (;;)
+    {
+      uint64_t seq = log_kmsg_seq;
+      uint64_t lost = 0;
+      log_record_t record;
+      if (!log_read (&seq, &lost, &record, false))
+        break;
+
+      if (lost)
+        {
+          int n = snprintf (line, sizeof (line), "# %llu records lost\n",
+                            lost);
+          if (len + n > size)
+            break;
+          memcpy (buf + len, line, n);
+          len += n;
+          log_kmsg_seq = seq - 1;
+        }
+
+      record.text[LOG_TEXT_SIZE - 1] = '\0';
+      size_t text_len = kstrlen (record.text);
+      bool newline = text_len > 0 && record.text[text_len - 1] == '\n';
+      int n = snprintf (line, sizeof (line), "%u,%llu,%llu,%s;%s%s",
+                        (unsigned int)record.level, seq - 1, record.tsc,
+                        record.cont ? "c" : "-", record.text,
+                        newline ? "" : "\n");
+      if (len + n > size)
+        break;
+      memcpy (buf + len, line, n);
+      len += n;
+      log_kmsg_seq = seq;
+    }
+
+  return len;
+}
+
+fs_operations_t kmsg_ops = {
+  .read = kmsg_read,
+};
@@ -18,9 +18,14 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/ktrace.h>
+#include <sys/mount.h>
 #include <sys/printk.h>
+#include <sys/proc.h>
 #include <sys/string.h>
+#include <x86_64/fpu.h>
 #include <x86_64/heap.h>
+#include <x86_64/page.h>
 #include <x86_64/vmm/vmm_map.h>
 
 /* The Osiris scheduler */
@@ -78,6 +83,8 @@ typedef struct Proc
   uint64_t pid;
   proc_state state;
   uint64_t *stack;
+  uint64_t faults[PROC_FAULT_KINDS];
+  void *fpu_state;
 } proc_t;
 
 void
@@ -85,6 +92,8 @@ idle_proc ()
 {
   for (;;)
     {
+      printk_flush ();
+      pmm_refill_zero_pool ();
       asm volatile ("hlt");
     }
 }
@@ -134,6 +143,9 @@ schedule ()
   new_proc->state = PROC_RUNNING;
   current_proc = new_proc;
 
+  ktrace ("sched: switch %u -> %u", current_proc_index, next_proc_index);
+  fpu_switch (new_proc->fpu_state);
+
   proc_switch_x64 (&old_proc->rsp, new_proc->rsp);
 }
 
@@ -151,8 +163,11 @@ proc_create (void (*entry_point) ())
   proc_t *new_proc = &proc_table[proc_count];
   new_proc->pid = proc_count;
   new_proc->state = PROC_READY;
+  memset (new_proc->faults, 0, sizeof (new_proc->faults));
+  new_proc->fpu_state = fpu_state_alloc ();
 
-  new_proc->stack = (uint64_t *)kmalloc (STACK_SIZE);
+  /* A page of its own, so overflowing it faults on an unmapped guard page */
+  new_proc->stack = (uint64_t *)kmalloc_aligned (STACK_SIZE, PAGE_SIZE);
   new_proc->rsp = (uint64_t)new_proc->stack + STACK_SIZE;
 
   new_proc->rsp -= 8;
@@ -214,6 +229,9 @@ proc_destroy (proc_t *proc)
         proc->stack = NULL;
     }
 
+    fpu_state_free (proc->fpu_state);
+    proc->fpu_state = NULL;
+
     proc->state = PROC_DEAD;
 
     int proc_index = proc - proc_table;
@@ -229,6 +247,43 @@ proc_destroy (proc_t *proc)
         current_proc = &proc_table[0];
 }
 
+void *
+proc_fpu_state (void)
+{
+  return current_proc ? current_proc->fpu_state : NULL;
+}
+
+void
+proc_count_fault (int kind)
+{
+  if (current_proc)
+    current_proc->faults[kind]++;
+}
+
+/* /dev/faults: one "pid demand cow bad" line per process */
+int
+proc_faults_read (char *data, void *buffer, int size)
+{
+  (void)data; /* unused */
+  char *buf = buffer;
+  int len = 0;
+
+  for (int i = 0; i < proc_count && len < size; i++)
+    {
+      proc_t *proc = &proc_table[i];
+      len += snprintf (buf + len, size - len, "%llu %llu %llu %llu\n",
+                       proc->pid, proc->faults[PROC_FAULT_DEMAND],
+                       proc->faults[PROC_FAULT_COW],
+                       proc->faults[PROC_FAULT_BAD]);
+    }
+
+  return len;
+}
+
+fs_operations_t proc_faults_ops = {
+  .read = proc_faults_read,
+};
+
 /* Initialise the scheduler */
 void
 proc_init ()
@@ -242,6 +297,7 @@ proc_init ()
   idle->pid = 0;
   idle->state = PROC_RUNNING;
   idle->stack = NULL;
+  idle->fpu_state = fpu_state_alloc ();
 
   /* Set global state */
   proc_count = 1;
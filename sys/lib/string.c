@@ -15,17 +15,53 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/string.h>
+#include <x86_64/cpu.h>
+
+/* memcpy and memset use the string instructions. With ERMS, rep movsb and
+ * rep stosb move whole cache lines internally and beat anything else once
+ * past their startup cost; FSRM removes that cost for short lengths too.
+ * Without them rep movsq/stosq does the bulk and a byte loop the tail.
+ * cpu_init() fills in cpu_features, so the choice is made at boot; before
+ * that the quadword path, which works everywhere, is used. */
+
+/* Below this, rep movsb/stosb without FSRM loses to rep movsq/stosq */
+#define STRING_ERMS_MIN 256
+
+typedef uint64_t __attribute__ ((may_alias, aligned (1))) string_word_t;
+
+static inline bool
+string_use_movsb (size_t n)
+{
+  return cpu_features.fsrm || (cpu_features.erms && n >= STRING_ERMS_MIN);
+}
 
 void *
-memcpy (void *restrict dest, const void *restrict src, int n)
+memcpy (void *restrict dest, const void *restrict src, size_t n)
 {
-  uint8_t *restrict pdest = (uint8_t *restrict)dest;
-  const uint8_t *restrict psrc = (const uint8_t *restrict)src;
+  void *d = dest;
 
-  for (int i = 0; i < n; i++)
+  if (string_use_movsb (n))
+    {
+      asm volatile ("rep movsb"
+                    : "+D"(d), "+S"(src), "+c"(n)
+                    :
+                    : "memory");
+      return dest;
+    }
+
+  size_t words = n / 8;
+  asm volatile ("rep movsq"
+                : "+D"(d), "+S"(src), "+c"(words)
+                :
+                : "memory");
+
+  uint8_t *pdest = d;
+  const uint8_t *psrc = src;
+  for (size_t i = 0; i < n % 8; i++)
     {
       pdest[i] = psrc[i];
     }
@@ -34,11 +70,28 @@ memcpy (void *restrict dest, const void *restrict src, int n)
 }
 
 void *
-memset (void *s, int c, int n)
+memset (void *s, int c, size_t n)
 {
-  uint8_t *p = (uint8_t *)s;
+  void *d = s;
 
-  for (int i = 0; i < n; i++)
+  if (string_use_movsb (n))
+    {
+      asm volatile ("rep stosb"
+                    : "+D"(d), "+c"(n)
+                    : "a"(c)
+                    : "memory");
+      return s;
+    }
+
+  size_t words = n / 8;
+  uint64_t pattern = (uint8_t)c * 0x0101010101010101ull;
+  asm volatile ("rep stosq"
+                : "+D"(d), "+c"(words)
+                : "a"(pattern)
+                : "memory");
+
+  uint8_t *p = d;
+  for (size_t i = 0; i < n % 8; i++)
     {
       p[i] = (uint8_t)c;
     }
@@ -47,36 +100,62 @@ memset (void *s, int c, int n)
 }
 
 void *
-memmove (void *dest, const void *src, int n)
+memmove (void *dest, const void *src, size_t n)
 {
   uint8_t *pdest = (uint8_t *)dest;
   const uint8_t *psrc = (const uint8_t *)src;
 
-  if (src > dest)
+  /* Forward copies are safe unless dest starts inside src */
+  if (pdest <= psrc || pdest >= psrc + n)
     {
-      for (int i = 0; i < n; i++)
-        {
-          pdest[i] = psrc[i];
-        }
+      return memcpy (dest, src, n);
     }
-  else if (src < dest)
+
+  /* Backwards: the odd tail bytes first, then whole words with the
+   * direction flag set. Fast strings don't apply going down, so this is
+   * always rep movsq. */
+  for (size_t i = n; i > n - n % 8; i--)
     {
-      for (int i = n; i > 0; i--)
-        {
-          pdest[i - 1] = psrc[i - 1];
-        }
+      pdest[i - 1] = psrc[i - 1];
+    }
+
+  size_t words = n / 8;
+  if (words)
+    {
+      void *d = pdest + words * 8 - 8;
+      const void *s = psrc + words * 8 - 8;
+      asm volatile ("std\n\t"
+                    "rep movsq\n\t"
+                    "cld"
+                    : "+D"(d), "+S"(s), "+c"(words)
+                    :
+                    : "memory");
     }
 
   return dest;
 }
 
 int
-memcmp (const void *s1, const void *s2, int n)
+memcmp (const void *s1, const void *s2, size_t n)
 {
   const uint8_t *p1 = (const uint8_t *)s1;
   const uint8_t *p2 = (const uint8_t *)s2;
+  size_t i = 0;
+
+  /* A word at a time until one differs; the lowest differing byte of
+   * the XOR is the first differing byte in memory */
+  for (; i + 8 <= n; i += 8)
+    {
+      uint64_t a = *(const string_word_t *)(p1 + i);
+      uint64_t b = *(const string_word_t *)(p2 + i);
+      if (a != b)
+        {
+          i += __builtin_ctzll (a ^ b) / 8;
+          return p1[i] < p2[i] ? -1 : 1;
+        }
+    }
 
-  for (int i = 0; i < n; i++)
+  for (; i < n; i++)
     {
       if (p1[i] != p2[i])
         {
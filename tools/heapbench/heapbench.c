@@ -0,0 +1,679 @@
+/*-
+ * SPDX-License-Identifier: 0BSD
+ *
+ * Copyright (c) 2025 V. Prokopenko
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* heapbench: run the kernel heap on the host against recorded traces and
+ * synthetic workloads, and report throughput, peak footprint and
+ * fragmentation.
+ *
+ * A trace is a text file with one call per line, ids being the pointers
+ * the kernel handed out (in hex):
+ *
+ *   a ID SIZE          kmalloc / kcalloc
+ *   m ID SIZE ALIGN    kmalloc_aligned
+ *   r OLD NEW SIZE     krealloc, OLD is 0 for NULL
+ *   f ID               kfree
+ *
+ * Lines starting with '#' are comments. A kernel built with -DKMEM_TRACE
+ * writes this format to /dev/kmemtrace. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <x86_64/heap.h>
+
+#include "heapbench.h"
+
+typedef struct
+{
+  char op; /* 'a', 'm', 'r' or 'f' */
+  uint32_t slot;
+  uint64_t size;
+  uint64_t align;
+} bench_op_t;
+
+typedef struct
+{
+  const char *name;
+  bench_op_t *ops;
+  size_t count;
+  size_t capacity;
+  uint32_t slots;
+} bench_t;
+
+static void
+bench_push (bench_t *bench, char op, uint32_t slot, uint64_t size,
+            uint64_t align)
+{
+  if (bench->count == bench->capacity)
+    {
+      bench->capacity = bench->capacity ? bench->capacity * 2 : 4096;
+      bench->ops = realloc (bench->ops, bench->capacity * sizeof (bench_op_t));
+      if (bench->ops == NULL)
+        {
+          perror ("heapbench");
+          exit (1);
+        }
+    }
+  bench->ops[bench->count++] = (bench_op_t){ op, slot, size, align };
+  if (slot >= bench->slots)
+    bench->slots = slot + 1;
+}
+
+/* Trace ids to slots: open addressing, id 0 marks an empty entry */
+
+typedef struct
+{
+  uint64_t id;
+  uint32_t slot;
+} id_entry_t;
+
+static id_entry_t *id_table;
+static size_t id_capacity;
+static size_t id_count;
+
+static id_entry_t *
+id_find (uint64_t id)
+{
+  size_t i = (id * 0x9E3779B97F4A7C15ull) >> 20;
+  for (;; i++)
+    {
+      id_entry_t *entry = &id_table[i & (id_capacity - 1)];
+      if (entry->id == id || entry->id == 0)
+        return entry;
+    }
+}
+
+static void
+id_insert (uint64_t id, uint32_t slot)
+{
+  if ((id_count + 1) * 2 > id_capacity)
+    {
+      id_entry_t *old = id_table;
+      size_t old_capacity = id_capacity;
+      id_capacity = id_capacity ? id_capacity * 2 : 1024;
+      id_table = calloc (id_capacity, sizeof (id_entry_t));
+      id_count = 0;
+      for (size_t i = 0; i < old_capacity; i++)
+        if (old[i].id)
+          id_insert (old[i].id, old[i].slot);
+      free (old);
+    }
+  id_entry_t *entry = id_find (id);
+  if (entry->id == 0)
+    id_count++;
+  entry->id = id;
+  entry->slot = slot;
+}
+
+/* Backward shift deletion keeps the probe sequences intact */
+static bool
+id_remove (uint64_t id, uint32_t *slot)
+{
+  if (id_capacity == 0)
+    return false;
+  id_entry_t *entry = id_find (id);
+  if (entry->id == 0)
+    return false;
+  *slot = entry->slot;
+
+  size_t mask = id_capacity - 1;
+  size_t hole = entry - id_table;
+  for (size_t i = (hole + 1) & mask; id_table[i].id; i = (i + 1) & mask)
+    {
+      size_t home = (id_table[i].id * 0x9E3779B97F4A7C15ull) >> 20 & mask;
+      if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+          id_table[hole] = id_table[i];
+          hole = i;
+        }
+    }
+  id_table[hole].id = 0;
+  id_count--;
+  return true;
+}
+
+static bool
+bench_load (bench_t *bench, const char *path)
+{
+  FILE *file = fopen (path, "r");
+  if (file == NULL)
+    {
+      perror (path);
+      return false;
+    }
+
+  char line[256];
+  uint32_t next_slot = 0;
+  unsigned long lineno = 0;
+  while (fgets (line, sizeof (line), file))
+    {
+      lineno++;
+      unsigned long long id, old, size, align;
+      uint32_t slot;
+
+      switch (line[0])
+        {
+        case '#':
+        case '\n':
+          continue;
+        case 'a':
+        case 'm':
+          align = 0;
+          if (sscanf (line + 1, "%llx %llu %llu", &id, &size, &align)
+              < (line[0] == 'm' ? 3 : 2))
+            break;
+          if (id == 0)
+            continue;
+          /* An id handed out again without a free we saw */
+          if (id_remove (id, &slot))
+            bench_push (bench, 'f', slot, 0, 0);
+          id_insert (id, next_slot);
+          bench_push (bench, line[0], next_slot++, size, align);
+          continue;
+        case 'r':
+          if (sscanf (line + 1, "%llx %llx %llu", &old, &id, &size) < 3)
+            break;
+          if (old == 0 || !id_remove (old, &slot))
+            {
+              /* krealloc(NULL) or a block from before the trace started */
+              if (id == 0)
+                continue;
+              slot = next_slot++;
+              id_insert (id, slot);
+              bench_push (bench, 'a', slot, size, 0);
+              continue;
+            }
+          if (id == 0)
+            {
+              bench_push (bench, 'f', slot, 0, 0);
+              continue;
+            }
+          id_insert (id, slot);
+          bench_push (bench, 'r', slot, size, 0);
+          continue;
+        case 'f':
+          if (sscanf (line + 1, "%llx", &id) < 1)
+            break;
+          if (id_remove (id, &slot))
+            bench_push (bench, 'f', slot, 0, 0);
+          continue;
+        }
+      fprintf (stderr, "%s:%lu: bad trace line\n", path, lineno);
+    }
+
+  fclose (file);
+  free (id_table);
+  id_table = NULL;
+  id_capacity = id_count = 0;
+  bench->name = path;
+  return true;
+}
+
+/* Synthetic workloads */
+
+static uint64_t rng_seed = 0x2545F4914F6CDD1Dull;
+static uint64_t rng_state;
+static uint64_t size_min = 16;
+static uint64_t size_max = 16384;
+
+static uint64_t
+rng (void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+/* Log-uniform between size_min and size_max: as many small as big ones */
+static uint64_t
+rng_size (void)
+{
+  int lo = 63 - __builtin_clzll (size_min);
+  int hi = 63 - __builtin_clzll (size_max);
+  int bit = lo + rng () % (hi - lo + 1);
+  uint64_t size = (1ull << bit) + rng () % (1ull << bit);
+  if (size < size_min)
+    size = size_min;
+  if (size > size_max)
+    size = size_max;
+  return size;
+}
+
+/* Random calls on up to 4096 live blocks: alloc into an empty slot, free
+ * or realloc a used one. One in ten allocations is aligned. */
+static void
+gen_random (bench_t *bench, size_t count)
+{
+  enum { SLOTS = 4096 };
+  static bool used[SLOTS];
+  memset (used, 0, sizeof (used));
+
+  while (bench->count < count)
+    {
+      uint32_t slot = rng () % SLOTS;
+      if (!used[slot])
+        {
+          if (rng () % 10 == 0)
+            bench_push (bench, 'm', slot, rng_size (), 64ull << rng () % 7);
+          else
+            bench_push (bench, 'a', slot, rng_size (), 0);
+          used[slot] = true;
+        }
+      else if (rng () % 5 == 0)
+        {
+          bench_push (bench, 'r', slot, rng_size (), 0);
+        }
+      else
+        {
+          bench_push (bench, 'f', slot, 0, 0);
+          used[slot] = false;
+        }
+    }
+}
+
+/* Allocate a batch, free it in reverse */
+static void
+gen_lifo (bench_t *bench, size_t count)
+{
+  while (bench->count < count)
+    {
+      uint32_t batch = 1 + rng () % 256;
+      for (uint32_t i = 0; i < batch; i++)
+        bench_push (bench, 'a', i, rng_size (), 0);
+      for (uint32_t i = batch; i-- > 0;)
+        bench_push (bench, 'f', i, 0, 0);
+    }
+}
+
+/* A queue of 1024 blocks: free the oldest, allocate a new one */
+static void
+gen_fifo (bench_t *bench, size_t count)
+{
+  enum { DEPTH = 1024 };
+  for (uint32_t i = 0; i < DEPTH; i++)
+    bench_push (bench, 'a', i, rng_size (), 0);
+  for (uint32_t i = 0; bench->count < count; i = (i + 1) % DEPTH)
+    {
+      bench_push (bench, 'f', i, 0, 0);
+      bench_push (bench, 'a', i, rng_size (), 0);
+    }
+}
+
+/* Bursts of messages queued by a producer and freed by a consumer, with
+ * one in 32 allocations replacing one of 512 long-lived blocks. The
+ * long-lived ones pin memory in between the messages. */
+static void
+gen_prodcons (bench_t *bench, size_t count)
+{
+  enum { DEPTH = 8192, PINNED = 512 };
+  static bool pinned[PINNED];
+  memset (pinned, 0, sizeof (pinned));
+  uint32_t head = 0, tail = 0;
+
+  while (bench->count < count)
+    {
+      uint32_t burst = rng () % 64;
+      for (uint32_t i = 0; i < burst && tail - head < DEPTH; i++)
+        {
+          if (rng () % 32 == 0)
+            {
+              uint32_t slot = DEPTH + rng () % PINNED;
+              if (pinned[slot - DEPTH])
+                bench_push (bench, 'f', slot, 0, 0);
+              bench_push (bench, 'a', slot, rng_size (), 0);
+              pinned[slot - DEPTH] = true;
+            }
+          bench_push (bench, 'a', tail++ % DEPTH, rng_size (), 0);
+        }
+      burst = rng () % 64;
+      for (uint32_t i = 0; i < burst && head != tail; i++)
+        bench_push (bench, 'f', head++ % DEPTH, 0, 0);
+    }
+}
+
+static const struct
+{
+  const char *name;
+  void (*generate) (bench_t *bench, size_t count);
+} workloads[] = {
+  { "random", gen_random },
+  { "lifo", gen_lifo },
+  { "fifo", gen_fifo },
+  { "prodcons", gen_prodcons },
+};
+
+#define WORKLOAD_COUNT (sizeof (workloads) / sizeof (workloads[0]))
+
+static bool
+bench_dump (bench_t *bench, const char *path)
+{
+  FILE *file = fopen (path, "w");
+  if (file == NULL)
+    {
+      perror (path);
+      return false;
+    }
+
+  /* Slots stand in for pointers; slot + 1 so that no id is 0 */
+  fprintf (file, "# heapbench %s, seed %llx\n", bench->name,
+           (unsigned long long)rng_seed);
+  for (size_t i = 0; i < bench->count; i++)
+    {
+      bench_op_t *op = &bench->ops[i];
+      unsigned long long id = op->slot + 1;
+      unsigned long long size = op->size;
+      switch (op->op)
+        {
+        case 'a':
+          fprintf (file, "a %llx %llu\n", id, size);
+          break;
+        case 'm':
+          fprintf (file, "m %llx %llu %llu\n", id, size,
+                   (unsigned long long)op->align);
+          break;
+        case 'r':
+          fprintf (file, "r %llx %llx %llu\n", id, id, size);
+          break;
+        case 'f':
+          fprintf (file, "f %llx\n", id);
+          break;
+        }
+    }
+  return fclose (file) == 0;
+}
+
+/* Replay */
+
+static bool check_contents = false;
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+fragmentation (const heap_usage_t *usage)
+{
+  return usage->free ? 100.0 * (1.0 - (double)usage->largest / usage->free)
+                     : 0.0;
+}
+
+static void
+fill (void *ptr, uint32_t slot, size_t from, size_t to)
+{
+  if (check_contents)
+    memset ((char *)ptr + from, slot * 37 + 1, to - from);
+}
+
+static void
+verify (void *ptr, uint32_t slot, size_t size, const char *name, size_t i)
+{
+  if (!check_contents)
+    return;
+  unsigned char want = slot * 37 + 1;
+  for (size_t k = 0; k < size; k++)
+    {
+      if (((unsigned char *)ptr)[k] != want)
+        {
+          fprintf (stderr, "%s: op %zu: block of slot %u corrupted\n", name,
+                   i, slot);
+          exit (1);
+        }
+    }
+}
+
+static void
+bench_run (bench_t *bench)
+{
+  void **ptrs = calloc (bench->slots, sizeof (void *));
+  uint64_t *sizes = calloc (bench->slots, sizeof (uint64_t));
+  if (ptrs == NULL || sizes == NULL)
+    {
+      perror ("heapbench");
+      exit (1);
+    }
+
+  /* Find the point of most live bytes to look at the heap there */
+  uint64_t live = 0, peak_live = 0;
+  size_t peak_op = 0;
+  for (size_t i = 0; i < bench->count; i++)
+    {
+      bench_op_t *op = &bench->ops[i];
+      if (op->op == 'f' || op->op == 'r')
+        live -= sizes[op->slot];
+      sizes[op->slot] = op->op == 'f' ? 0 : op->size;
+      live += sizes[op->slot];
+      if (live > peak_live)
+        {
+          peak_live = live;
+          peak_op = i;
+        }
+    }
+  memset (sizes, 0, bench->slots * sizeof (uint64_t));
+
+  /* Footprint counts everything held from the PMM, including what the heap
+   * kept from earlier runs */
+  host_pages_peak = host_pages_in_use;
+  heap_usage_t at_peak = { 0 }, at_end;
+  size_t failed = 0;
+  double elapsed = 0;
+  double start = now ();
+
+  for (size_t i = 0; i < bench->count; i++)
+    {
+      bench_op_t *op = &bench->ops[i];
+      void *ptr = ptrs[op->slot];
+      switch (op->op)
+        {
+        case 'a':
+        case 'm':
+          /* Slot reused without a free: a mangled trace, keep going */
+          if (ptr)
+            kfree (ptr);
+          ptr = op->op == 'm' ? kmalloc_aligned (op->size, op->align)
+                              : kmalloc (op->size);
+          if (ptr)
+            fill (ptr, op->slot, 0, op->size);
+          sizes[op->slot] = ptr ? op->size : 0;
+          break;
+        case 'r':
+          {
+            void *new_ptr = krealloc (ptr, op->size);
+            if (new_ptr)
+              {
+                uint64_t kept = sizes[op->slot] < op->size ? sizes[op->slot]
+                                                           : op->size;
+                verify (new_ptr, op->slot, kept, bench->name, i);
+                fill (new_ptr, op->slot, kept, op->size);
+                ptr = new_ptr;
+                sizes[op->slot] = op->size;
+              }
+            else
+              {
+                failed++;
+              }
+            break;
+          }
+        case 'f':
+          if (ptr)
+            {
+              verify (ptr, op->slot, sizes[op->slot], bench->name, i);
+              kfree (ptr);
+            }
+          ptr = NULL;
+          sizes[op->slot] = 0;
+          break;
+        }
+      if (ptr == NULL && op->op != 'f')
+        failed++;
+      ptrs[op->slot] = ptr;
+
+      if (i == peak_op)
+        {
+          elapsed += now () - start;
+          heap_get_usage (&at_peak);
+          start = now ();
+        }
+    }
+
+  elapsed += now () - start;
+  heap_get_usage (&at_end);
+  uint64_t peak_pages = host_pages_peak;
+
+  for (uint32_t slot = 0; slot < bench->slots; slot++)
+    kfree (ptrs[slot]);
+  free (ptrs);
+  free (sizes);
+
+  printf ("%-10s %9zu %8.2f %10llu %10llu %6.2f %6.1f%% %6.1f%%",
+          bench->name, bench->count, bench->count / elapsed / 1e6,
+          (unsigned long long)peak_live,
+          (unsigned long long)peak_pages * 4096,
+          peak_live ? peak_pages * 4096.0 / peak_live : 0.0,
+          fragmentation (&at_peak), fragmentation (&at_end));
+  if (failed)
+    printf (" (%zu failed)", failed);
+  printf ("\n");
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+           "usage: heapbench [-c] [-n ops] [-s seed] [-m min] [-M max]\n"
+           "                 [-w workload] [-o dump] [trace ...]\n"
+           "\n"
+           "  -c  fill blocks and check them on free and realloc\n"
+           "  -n  operations per synthetic workload (1000000)\n"
+           "  -s  random seed\n"
+           "  -m  -M  smallest and largest synthetic request (16, 16384)\n"
+           "  -w  random, lifo, fifo or prodcons; may be repeated,\n"
+           "      all of them when no trace is given\n"
+           "  -o  write the synthetic workloads as one trace instead\n");
+  exit (2);
+}
+
+int
+main (int argc, char **argv)
+{
+  size_t count = 1000000;
+  const char *dump = NULL;
+  bool selected[WORKLOAD_COUNT] = { false };
+  bool any_selected = false;
+
+  int opt;
+  while ((opt = getopt (argc, argv, "cn:s:m:M:w:o:")) != -1)
+    {
+      switch (opt)
+        {
+        case 'c':
+          check_contents = true;
+          break;
+        case 'n':
+          count = strtoull (optarg, NULL, 0);
+          break;
+        case 's':
+          rng_seed = strtoull (optarg, NULL, 0) | 1;
+          break;
+        case 'm':
+          size_min = strtoull (optarg, NULL, 0);
+          break;
+        case 'M':
+          size_max = strtoull (optarg, NULL, 0);
+          break;
+        case 'w':
+          {
+            size_t i = 0;
+            while (i < WORKLOAD_COUNT && strcmp (optarg, workloads[i].name))
+              i++;
+            if (i == WORKLOAD_COUNT)
+              usage ();
+            selected[i] = any_selected = true;
+            break;
+          }
+        case 'o':
+          dump = optarg;
+          break;
+        default:
+          usage ();
+        }
+    }
+  if (size_min == 0 || size_max < size_min)
+    usage ();
+  if (!any_selected && optind == argc)
+    for (size_t i = 0; i < WORKLOAD_COUNT; i++)
+      selected[i] = true;
+
+  host_init ();
+  heap_init ();
+  rng_state = rng_seed;
+
+  if (dump == NULL)
+    printf ("%-10s %9s %8s %10s %10s %6s %7s %7s\n", "workload", "ops",
+            "Mops/s", "peak-live", "footprint", "ratio", "frag@pk",
+            "frag@end");
+
+  bench_t all = { .name = "synthetic" };
+  uint32_t slot_base = 0;
+  for (size_t i = 0; i < WORKLOAD_COUNT; i++)
+    {
+      if (!selected[i])
+        continue;
+      bench_t bench = { .name = workloads[i].name };
+      workloads[i].generate (&bench, count);
+      if (dump)
+        {
+          /* Keep the workloads apart in the combined trace */
+          for (size_t k = 0; k < bench.count; k++)
+            {
+              bench_op_t *op = &bench.ops[k];
+              bench_push (&all, op->op, op->slot + slot_base, op->size,
+                          op->align);
+            }
+          slot_base = all.slots;
+        }
+      else
+        {
+          bench_run (&bench);
+        }
+      free (bench.ops);
+    }
+  if (dump)
+    return bench_dump (&all, dump) ? 0 : 1;
+
+  int status = 0;
+  for (int i = optind; i < argc; i++)
+    {
+      bench_t bench = { 0 };
+      if (!bench_load (&bench, argv[i]))
+        {
+          status = 1;
+          continue;
+        }
+      bench_run (&bench);
+      free (bench.ops);
+    }
+  return status;
+}
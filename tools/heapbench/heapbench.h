@@ -0,0 +1,37 @@
+/*-
+ * SPDX-License-Identifier: 0BSD
+ *
+ * Copyright (c) 2025 V. Prokopenko
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Included ahead of every file of the host build (see the Makefile), so
+ * the kernel sources pick up the host heap windows */
+
+#pragma once
+
+#include <stdint.h>
+
+extern uintptr_t heapbench_window;
+
+#define KERNEL_HEAP_START heapbench_window
+#define KERNEL_HEAP_MAX_SIZE (1ull * 1024 * 1024 * 1024)
+#define KERNEL_LARGE_SIZE (1ull * 1024 * 1024 * 1024)
+#define HOST_WINDOW_SIZE (KERNEL_HEAP_MAX_SIZE + KERNEL_LARGE_SIZE)
+
+/* Pages held from the host PMM right now, and the most ever held */
+extern uint64_t host_pages_in_use;
+extern uint64_t host_pages_peak;
+
+/* Set up the arena and the windows. Call before heap_init() */
+void host_init (void);
@@ -0,0 +1,285 @@
+/*-
+ * SPDX-License-Identifier: 0BSD
+ *
+ * Copyright (c) 2025 V. Prokopenko
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Host side of the kernel heap benchmark: the PMM, VMM and CPU functions
+ * heap.c and slab.c need, on top of an mmap arena.
+ *
+ * "Physical memory" is a sparse memfd. The HHDM maps all of it, and mapping
+ * a page into the heap windows maps the same file page there, so the
+ * allocators see exactly the aliasing they get in the kernel. */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <x86_64/cpu.h>
+#include <x86_64/page.h>
+#include <x86_64/vmm/vmm_map.h>
+#include <x86_64/vmm/vmm_range.h>
+#include <x86_64/vmm/vmm_region.h>
+#include <sys/panic.h>
+
+#include "heapbench.h"
+
+#define HOST_PHYS_SIZE (16ull * 1024 * 1024 * 1024)
+#define HOST_HHDM_ALIGN (1ull * 1024 * 1024 * 1024)
+
+uintptr_t heapbench_window;
+
+volatile struct limine_hhdm_request hhdm_request;
+static struct limine_hhdm_response hhdm_response;
+pagemap_t *kernel_pagemap = NULL;
+uintptr_t hhdm_offset;
+
+static int phys_fd = -1;
+static uint8_t *hhdm_base;
+static uint64_t phys_next = PAGE_SIZE; /* keep 0 out, it means failure */
+static uint64_t phys_free[PMM_MAX_ORDER + 1];
+
+/* Physical address + 1 behind every page of the windows, 0 if unmapped */
+static uint64_t *window_table;
+
+uint64_t host_pages_in_use;
+uint64_t host_pages_peak;
+
+void
+host_init (void)
+{
+  phys_fd = memfd_create ("heapbench", 0);
+  if (phys_fd < 0 || ftruncate (phys_fd, HOST_PHYS_SIZE) < 0)
+    {
+      perror ("heapbench: memfd");
+      exit (1);
+    }
+  /* The slab layer finds slab headers by masking HHDM addresses, so the
+   * HHDM has to be aligned like the kernel's */
+  uint8_t *reserve = mmap (NULL, HOST_PHYS_SIZE + HOST_HHDM_ALIGN, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  hhdm_base = MAP_FAILED;
+  if (reserve != MAP_FAILED)
+    hhdm_base = mmap ((void *)ALIGN_UP ((uintptr_t)reserve, HOST_HHDM_ALIGN),
+                      HOST_PHYS_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED | MAP_NORESERVE, phys_fd, 0);
+  void *window = mmap (NULL, HOST_WINDOW_SIZE, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  window_table = calloc (HOST_WINDOW_SIZE / PAGE_SIZE, sizeof (uint64_t));
+  if (hhdm_base == MAP_FAILED || window == MAP_FAILED || window_table == NULL)
+    {
+      perror ("heapbench: mmap");
+      exit (1);
+    }
+
+  heapbench_window = (uintptr_t)window;
+  hhdm_response.offset = (uintptr_t)hhdm_base;
+  hhdm_request.response = &hhdm_response;
+  hhdm_offset = hhdm_response.offset;
+}
+
+/* Free lists per order, linked through the pages themselves. Blocks are
+ * not merged again; the arena is big enough that it doesn't matter. */
+void *
+allocate_pages (size_t order)
+{
+  if (order > PMM_MAX_ORDER)
+    return NULL;
+
+  uint64_t size = (uint64_t)PAGE_SIZE << order;
+  uint64_t phys = phys_free[order];
+  if (phys)
+    {
+      phys_free[order] = *(uint64_t *)(hhdm_base + phys);
+    }
+  else
+    {
+      phys = ALIGN_UP (phys_next, size);
+      if (phys + size > HOST_PHYS_SIZE)
+        return NULL;
+      phys_next = phys + size;
+    }
+
+  memset (hhdm_base + phys, 0, size);
+  host_pages_in_use += 1ull << order;
+  if (host_pages_in_use > host_pages_peak)
+    host_pages_peak = host_pages_in_use;
+  return (void *)phys;
+}
+
+void *
+allocate_page (void)
+{
+  return allocate_pages (0);
+}
+
+void
+free_pages (void *base, size_t order)
+{
+  uint64_t phys = (uintptr_t)base;
+  *(uint64_t *)(hhdm_base + phys) = phys_free[order];
+  phys_free[order] = phys;
+  host_pages_in_use -= 1ull << order;
+}
+
+void
+free_page (void *page)
+{
+  free_pages (page, 0);
+}
+
+bool
+vmm_map_range (pagemap_t *pagemap, uintptr_t virt_addr, uintptr_t phys_addr,
+               size_t length, uint64_t flags)
+{
+  (void)pagemap;
+  (void)flags;
+  if (mmap ((void *)virt_addr, length, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, phys_fd, phys_addr)
+      == MAP_FAILED)
+    return false;
+
+  uint64_t *entry = &window_table[(virt_addr - heapbench_window) / PAGE_SIZE];
+  for (size_t off = 0; off < length; off += PAGE_SIZE)
+    *entry++ = phys_addr + off + 1;
+  return true;
+}
+
+bool
+vmm_unmap_range (pagemap_t *pagemap, uintptr_t virt_addr, size_t length)
+{
+  (void)pagemap;
+  mmap ((void *)virt_addr, length, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+  memset (&window_table[(virt_addr - heapbench_window) / PAGE_SIZE], 0,
+          length / PAGE_SIZE * sizeof (uint64_t));
+  return true;
+}
+
+/* Regions are backed right away here, there is no page fault handler to do
+ * it on first touch. Every one is followed by an unmapped guard page, so
+ * the window table tells where it ends. */
+static size_t
+host_region_length (uintptr_t base)
+{
+  uint64_t *entry = &window_table[(base - heapbench_window) / PAGE_SIZE];
+  size_t length = 0;
+  while (base + length < heapbench_window + HOST_WINDOW_SIZE
+         && entry[length / PAGE_SIZE])
+    length += PAGE_SIZE;
+  return length;
+}
+
+static void
+host_unback (uintptr_t base, size_t length)
+{
+  for (uintptr_t virt = base; virt < base + length; virt += PAGE_SIZE)
+    free_page ((void *)vmm_virt_to_phys (NULL, virt));
+  vmm_unmap_range (NULL, base, length);
+}
+
+static bool
+host_back (uintptr_t base, size_t length)
+{
+  for (size_t off = 0; off < length; off += PAGE_SIZE)
+    {
+      void *phys = allocate_page ();
+      if (phys == NULL
+          || !vmm_map_range (NULL, base + off, (uintptr_t)phys, PAGE_SIZE, 0))
+        {
+          if (phys)
+            free_page (phys);
+          host_unback (base, off);
+          return false;
+        }
+    }
+  return true;
+}
+
+bool
+vmm_reserve (pagemap_t *pagemap, uintptr_t base, size_t length,
+             uint64_t flags)
+{
+  (void)pagemap;
+  (void)flags;
+  return host_back (base, length);
+}
+
+bool
+vmm_release (pagemap_t *pagemap, uintptr_t base)
+{
+  (void)pagemap;
+  host_unback (base, host_region_length (base));
+  return true;
+}
+
+bool
+vmm_resize (pagemap_t *pagemap, uintptr_t base, size_t length)
+{
+  (void)pagemap;
+  size_t old_length = host_region_length (base);
+  if (length < old_length)
+    host_unback (base + length, old_length - length);
+  else if (length > old_length)
+    return host_back (base + old_length, length - old_length);
+  return true;
+}
+
+uintptr_t
+vmm_virt_to_phys (pagemap_t *pagemap, uintptr_t virt_addr)
+{
+  (void)pagemap;
+  uint64_t entry
+      = window_table[(virt_addr - heapbench_window) / PAGE_SIZE];
+  return entry ? entry - 1 + virt_addr % PAGE_SIZE : 0;
+}
+
+/* Single threaded, nothing to mask */
+uint64_t
+cpu_irq_save (void)
+{
+  return 0;
+}
+
+void
+cpu_irq_restore (uint64_t flags)
+{
+  (void)flags;
+}
+
+void
+panic (const char *fmt)
+{
+  fprintf (stderr, "heapbench: panic: %s\n", fmt);
+  abort ();
+}
+
+void
+printk (const char *fmt, ...)
+{
+  va_list args;
+  va_start (args, fmt);
+  vfprintf (stderr, fmt, args);
+  va_end (args);
+}
+
+const struct ksym *
+odb_addr_to_sym (uint64_t rip)
+{
+  (void)rip;
+  return NULL;
+}
@@ -0,0 +1,212 @@
+/*-
+ * SPDX-License-Identifier: 0BSD
+ *
+ * Copyright (c) 2025 V. Prokopenko
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* ktrace: format a /dev/ktraceraw dump on the host.
+ *
+ *   ktrace [-r] osiris.elf [dump]
+ *
+ * The records only hold the address of their format string; it is looked
+ * up in the sections of the kernel image the dump was taken from, as are
+ * the strings %s arguments point to. The output matches /dev/ktrace, one
+ * "tsc text" line per event, with -r making the timestamps relative to the
+ * first event. */
+
+#include <elf.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ktrace.h>
+
+static unsigned char *image;
+static size_t image_size;
+static Elf64_Shdr *sections;
+static int section_count;
+
+static void
+die (const char *msg)
+{
+  fprintf (stderr, "ktrace: %s\n", msg);
+  exit (1);
+}
+
+static void
+load_image (const char *path)
+{
+  FILE *file = fopen (path, "rb");
+  if (!file)
+    {
+      perror (path);
+      exit (1);
+    }
+  fseek (file, 0, SEEK_END);
+  image_size = ftell (file);
+  rewind (file);
+  image = malloc (image_size);
+  if (!image || fread (image, 1, image_size, file) != image_size)
+    die ("cannot read the kernel image");
+  fclose (file);
+
+  Elf64_Ehdr *ehdr = (Elf64_Ehdr *)image;
+  if (image_size < sizeof (*ehdr) || memcmp (ehdr->e_ident, ELFMAG, SELFMAG)
+      || ehdr->e_ident[EI_CLASS] != ELFCLASS64)
+    die ("not a 64 bit ELF file");
+  if (ehdr->e_shoff + (size_t)ehdr->e_shnum * sizeof (Elf64_Shdr)
+      > image_size)
+    die ("truncated section headers");
+  sections = (Elf64_Shdr *)(image + ehdr->e_shoff);
+  section_count = ehdr->e_shnum;
+}
+
+/* The string at kernel address `addr', NULL if the image has no string
+ * there */
+static const char *
+image_string (uint64_t addr)
+{
+  for (int i = 0; i < section_count; i++)
+    {
+      Elf64_Shdr *shdr = &sections[i];
+      if (!(shdr->sh_flags & SHF_ALLOC) || shdr->sh_type == SHT_NOBITS)
+        continue;
+      if (addr < shdr->sh_addr || addr >= shdr->sh_addr + shdr->sh_size
+          || shdr->sh_offset + shdr->sh_size > image_size)
+        continue;
+
+      const char *s
+          = (const char *)image + shdr->sh_offset + (addr - shdr->sh_addr);
+      size_t left = shdr->sh_addr + shdr->sh_size - addr;
+      return memchr (s, '\0', left) ? s : NULL;
+    }
+  return NULL;
+}
+
+/* Format like the kernel's snprintf_raw(): %s %d %x %u %llu %llx */
+static void
+print_event (const char *fmt, const uint64_t *args, int nargs)
+{
+  int arg = 0;
+#define NEXT() (arg < nargs ? args[arg++] : 0)
+
+  for (; *fmt; fmt++)
+    {
+      if (*fmt != '%')
+        {
+          putchar (*fmt);
+          continue;
+        }
+
+      fmt++;
+      if (*fmt == 's')
+        {
+          uint64_t addr = NEXT ();
+          const char *s = image_string (addr);
+          if (s)
+            fputs (s, stdout);
+          else
+            printf ("(%#llx)", (unsigned long long)addr);
+        }
+      else if (*fmt == 'd')
+        printf ("%d", (int)NEXT ());
+      else if (*fmt == 'x')
+        printf ("%X", (unsigned int)NEXT ());
+      else if (*fmt == 'u')
+        printf ("%u", (unsigned int)NEXT ());
+      else if (!strncmp (fmt, "llu", 3))
+        {
+          printf ("%llu", (unsigned long long)NEXT ());
+          fmt += 2;
+        }
+      else if (!strncmp (fmt, "llx", 3))
+        {
+          printf ("%016llX", (unsigned long long)NEXT ());
+          fmt += 2;
+        }
+      else if (*fmt)
+        putchar (*fmt);
+      else
+        break;
+    }
+  putchar ('\n');
+#undef NEXT
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr, "usage: ktrace [-r] osiris.elf [dump]\n");
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  bool relative = false;
+  int opt;
+  while ((opt = getopt (argc, argv, "r")) != -1)
+    {
+      if (opt == 'r')
+        relative = true;
+      else
+        usage ();
+    }
+  if (optind >= argc || argc - optind > 2)
+    usage ();
+
+  load_image (argv[optind]);
+  FILE *in = stdin;
+  if (argc - optind == 2)
+    {
+      in = fopen (argv[optind + 1], "rb");
+      if (!in)
+        {
+          perror (argv[optind + 1]);
+          return 1;
+        }
+    }
+
+  ktrace_record_t record;
+  uint64_t expect = 0;
+  uint64_t first_tsc = 0;
+  bool first = true;
+  while (fread (&record, sizeof (record), 1, in) == 1)
+    {
+      if (record.seq == 0)
+        continue;
+      uint64_t seq = record.seq - 1;
+      if (first)
+        first_tsc = record.tsc;
+      if (seq > expect)
+        printf ("# %llu records lost\n", (unsigned long long)(seq - expect));
+      first = false;
+      expect = seq + 1;
+
+      printf ("%llu ", (unsigned long long)(relative ? record.tsc - first_tsc
+                                                       : record.tsc));
+      int nargs = record.nargs > KTRACE_MAX_ARGS ? KTRACE_MAX_ARGS
+                                                 : (int)record.nargs;
+      const char *fmt = image_string (record.fmt);
+      if (fmt)
+        print_event (fmt, record.args, nargs);
+      else
+        printf ("(format %#llx not in image)\n",
+                (unsigned long long)record.fmt);
+    }
+
+  return 0;
+}
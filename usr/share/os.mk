@@ -49,6 +49,21 @@ LDFLAGS  = -nostdlib -static -m elf_x86_64  -z max-page-size=0x1000 \
 		  --gc-sections -T sys/arch/x86_64/conf/kern.ld  
 ASMFLAGS	= -f elf64
 
+# Files named *_sse.c and *_avx2.c are built with vector code generation on.
+# Everything in them may only run between kernel_fpu_begin() and
+# kernel_fpu_end(), and *_avx2.c code only if cpu_features.avx2 is set.
+SSE_CFLAGS	= $(filter-out -mno-mmx -mno-sse -mno-sse2,$(CFLAGS)) -msse2
+AVX2_CFLAGS	= $(SSE_CFLAGS) -mavx2
+
+# Uncomment to tag every kernel heap allocation with its call site. Live
+# memory per call site then shows up in /dev/kmemstat. Costs 16 bytes per
+# allocation.
+#CPPFLAGS += -DKMEM_TRACK
+
+# Uncomment to log every kernel heap call to /dev/kmemtrace, for replay
+# with tools/heapbench.
+#CPPFLAGS += -DKMEM_TRACE
+
 BUILD_DIR ?= ../build
 
 DEPFLAGS := -MMD -MP -MF $(@:.o=.d)